@@ -0,0 +1,25 @@
+#!/bin/bash
+# Compare the switch and threaded engines of ../retro, and the threaded
+# engine with the JIT compiler, on each benchmark.
+#
+#   make compare
+#
+# Each benchmark is saved into a local retroImage with its test word as
+# the boot word, then the image is run once per engine. The jit column is blank where
+# ../retro was built without the JIT compiler.
+
+TIMEFORMAT=%R
+RETRO=../retro
+
+printf "%-12s %10s %10s %10s\n" "benchmark" "switch" "threaded" "jit"
+for target in factorial case fib loops; do
+  make -s $target
+  s=$( { time $RETRO --switch </dev/null >/dev/null; } 2>&1 )
+  t=$( { time $RETRO </dev/null >/dev/null; } 2>&1 )
+  j=
+  if $RETRO --help | grep -q -- --jit; then
+    j=$( { time $RETRO --jit </dev/null >/dev/null; } 2>&1 )
+  fi
+  printf "%-12s %10s %10s %10s\n" $target $s $t "$j"
+done
+rm -f retroImage
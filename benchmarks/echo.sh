@@ -0,0 +1,59 @@
+#!/bin/bash
+# Count the socket calls made by an echo server running on the socket
+# VM in vm/experimental. The server is run once building each line with
+# recv and replying with send, then once reading lines with recvUntil
+# and replying with write.
+#
+#   make echo
+#
+# A client in a second VM sends LINES lines (default 10000), in batches
+# of 100, and reads each batch back. Pass a number to change LINES.
+
+TIMEFORMAT=%R
+LINES=${1:-10000}
+PORT=9125
+
+cc -O2 ../vm/experimental/retro-sockets.c -o retro-sockets
+cp ../retroImage .
+
+cat >client.rx <<CLIENT
+include ../vm/experimental/sockets.rx
+with socket'
+variable server
+create line 1024 allot
+create eol 10 , 0 ,
+socket !server
+"127.0.0.1" $PORT @server connect drop
+: batch
+  100 [ "a line of text for the echo server to send back" @server write drop
+        eol @server write drop ] times
+  100 [ line 1024 10 @server recvUntil drop ] times ;
+$LINES 100 / [ batch ] times
+@server close drop bye
+CLIENT
+
+for mode in bytes lines; do
+  cat >server.rx <<SERVER
+include ../vm/experimental/sockets.rx
+with socket'
+variables| listener client done |
+create line 1024 allot
+: byte ( a-af )
+  @client recv dup 0 = [ drop done on 0 ] [ dup 10 = [ swap !+ 0 ] [ swap !+ -1 ] if ] if ;
+: bytes ( - )
+  repeat line [ byte ] while 0 swap ! @done if; line @client send drop again ;
+: lines ( - )
+  repeat line 1024 10 @client recvUntil 0; drop line @client write drop again ;
+socket !listener
+@listener $PORT bind drop @listener listen drop
+@listener accept !client
+$mode @client close drop @listener close drop bye
+SERVER
+  ./retro-sockets --stats --with server.rx </dev/null >server.out &
+  sleep 1
+  t=$( { time ./retro-sockets --with client.rx </dev/null >/dev/null; } 2>&1 )
+  wait
+  printf "%-8s %10s calls %8s seconds\n" $mode \
+    $(grep "Socket I/O calls" server.out | cut -d: -f2) $t
+done
+rm -f retro-sockets retroImage client.rx server.rx server.out
@@ -0,0 +1,27 @@
+#!/bin/bash
+# Time loading a large generated source file with --with, as done with
+# data tables kept in .rx files.
+#
+#   make includes
+#
+# The file holds ROWS rows, each a comment and a line of four values
+# compiled into a table. Pass a number to change ROWS (default 20000).
+
+TIMEFORMAT=%R
+RETRO=../retro
+ROWS=${1:-20000}
+
+awk -v rows=$ROWS 'BEGIN {
+  print "create table"
+  for (i = 0; i < rows; i++) {
+    printf "( row %d: values for the table, kept with a note on each row )\n", i
+    printf "%d , %d , %d , %d ,\n", i, i * 3, i * 7, i % 13
+  }
+  print "bye"
+}' >table.rx
+
+cp ../retroImage .
+printf "%-12s %10s %10s\n" "benchmark" "bytes" "seconds"
+t=$( { time $RETRO --with table.rx </dev/null >/dev/null; } 2>&1 )
+printf "%-12s %10s %10s\n" includes $(wc -c <table.rx) $t
+rm -f table.rx retroImage
@@ -0,0 +1,41 @@
+#!/bin/bash
+# Time random fetches and stores over a large heap, with the image in
+# normal pages and then with --huge.
+#
+#   make random
+#
+# The heap is CELLS cells (default 16777216, which must be a power of
+# two) past the first 1048576. Each of STEPS steps (20000000) picks a
+# cell with a linear congruential generator and increments it. Pass
+# numbers to change CELLS and STEPS. With --huge, the VM uses explicit
+# huge pages if enough are reserved in /proc/sys/vm/nr_hugepages, and
+# transparent huge pages if not.
+
+TIMEFORMAT=%R
+RETRO=../retro
+CELLS=${1:-16777216}
+STEPS=${2:-20000000}
+
+cp ../retroImage .
+cat >random.rx <<RANDOM
+: query 5 out wait 5 in ;
+1048576 $CELLS + -24 query drop
+variable seed
+: step @seed 1103515245 * 12345 + dup !seed
+  8 >> $((CELLS - 1)) and 1048576 + dup @ 1+ swap ! ;
+: steps $STEPS [ step ] times ;
+steps bye
+RANDOM
+
+printf "%-8s %10s %10s\n" "pages" "threaded" "jit"
+for pages in normal huge; do
+  flags=
+  [ $pages = huge ] && flags=--huge
+  t=$( { time $RETRO $flags --with random.rx </dev/null >/dev/null; } 2>&1 )
+  j=
+  if $RETRO --help | grep -q -- --jit; then
+    j=$( { time $RETRO $flags --jit --with random.rx </dev/null >/dev/null; } 2>&1 )
+  fi
+  printf "%-8s %10s %10s\n" $pages $t "$j"
+done
+rm -f retroImage random.rx
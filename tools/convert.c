@@ -15,12 +15,22 @@ int16_t output16BE[1000000];
 int32_t output32BE[1000000];
 int64_t output64BE[1000000];
 
+uint16_t bitswap16(uint16_t x)
+{
+  return (uint16_t)((x << 8) | (x >> 8));
+}
+
 uint32_t bitswap32(uint32_t x)
 {
   return ((x << 24) & 0xff000000) |
          ((x <<  8) & 0x00ff0000) |
-         ((x <<  8) & 0x0000ff00) |
-         ((x << 24) & 0x000000ff);
+         ((x >>  8) & 0x0000ff00) |
+         ((x >> 24) & 0x000000ff);
+}
+
+uint64_t bitswap64(uint64_t x)
+{
+  return ((uint64_t)bitswap32((uint32_t)x) << 32) | bitswap32(x >> 32);
 }
 
 int load_image(char *image)
@@ -76,19 +86,17 @@ int save_image()
 void convert()
 {
   int i, cells;
-  int32_t be;
   fprintf(stderr, "Loading...\n");
   cells = load_image("retroImage");
 
   fprintf(stderr, "Converting...\n");
   for (i = 0; i < cells; i++)
   {
-    be = bitswap32(input[i]);
     output16[i] = (int16_t)input[i];
     output64[i] = (int64_t)input[i];
-    output16BE[i] = (int16_t)be;
-    output32BE[i] = be;
-    output64BE[i] = (int64_t)be;
+    output16BE[i] = (int16_t)bitswap16((uint16_t)input[i]);
+    output32BE[i] = (int32_t)bitswap32((uint32_t)input[i]);
+    output64BE[i] = (int64_t)bitswap64((uint64_t)output64[i]);
   }
 
   fprintf(stderr, "Saving...\n\n");
@@ -0,0 +1,206 @@
+/******************************************************
+ * Generate the fused handlers for the threaded engine
+ * in vm/complete/retro.c from opcode profiles.
+ *
+ * Record a profile with:
+ *   ./retro --ngrams profile ...
+ *
+ * Then:
+ *   ./fuse [-n count] profile ... >vm/complete/fused.h
+ *
+ * Each profile line is a count followed by two or
+ * three opcode names. Counts for the same sequence
+ * in different profiles are added together.
+ ******************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SEQUENCES 4096
+#define MAX_FUSED      256
+
+/* Names as used by --ngrams, and the matching names in retro.c. The
+   'operand' column counts the cells following the opcode, and 'last'
+   marks instructions that may change IP or the image, so they may
+   only end a sequence. */
+struct opcode {
+  char *name, *id;
+  int operand, last;
+} opcodes[] = {
+  { "NOP",    "NOP",       0, 0 }, { "LIT",    "LIT",       1, 0 },
+  { "DUP",    "DUP",       0, 0 }, { "DROP",   "DROP",      0, 0 },
+  { "SWAP",   "SWAP",      0, 0 }, { "PUSH",   "PUSH",      0, 0 },
+  { "POP",    "POP",       0, 0 }, { "LOOP",   "LOOP",      1, 1 },
+  { "JUMP",   "JUMP",      1, 1 }, { "RETURN", "RETURN",    0, 1 },
+  { ">JUMP",  "GT_JUMP",   1, 1 }, { "<JUMP",  "LT_JUMP",   1, 1 },
+  { "!JUMP",  "NE_JUMP",   1, 1 }, { "=JUMP",  "EQ_JUMP",   1, 1 },
+  { "FETCH",  "FETCH",     0, 0 }, { "STORE",  "STORE",     0, 1 },
+  { "ADD",    "ADD",       0, 0 }, { "SUB",    "SUB",       0, 0 },
+  { "MUL",    "MUL",       0, 0 }, { "DIVMOD", "DIVMOD",    0, 0 },
+  { "AND",    "AND",       0, 0 }, { "OR",     "OR",        0, 0 },
+  { "XOR",    "XOR",       0, 0 }, { "SHL",    "SHL",       0, 0 },
+  { "SHR",    "SHR",       0, 0 }, { "0;",     "ZERO_EXIT", 0, 1 },
+  { "INC",    "INC",       0, 0 }, { "DEC",    "DEC",       0, 0 },
+  { "IN",     "IN",        0, 0 }, { "OUT",    "OUT",       0, 0 },
+  { "WAIT",   "WAIT",      0, 1 }, { "CALL",   "CALL",      0, 1 },
+};
+#define NUM_OPCODES (int)(sizeof(opcodes) / sizeof(opcodes[0]))
+
+struct sequence {
+  int length, ops[3];
+  unsigned long long count, score;
+} sequences[MAX_SEQUENCES];
+int count;
+
+int lookup(char *name)
+{
+  int i;
+  for (i = 0; i < NUM_OPCODES; i++)
+    if (strcmp(opcodes[i].name, name) == 0)
+      return i;
+  return -1;
+}
+
+void add(int length, int *ops, unsigned long long n)
+{
+  int i;
+  for (i = 0; i < count; i++)
+    if (sequences[i].length == length &&
+        memcmp(sequences[i].ops, ops, length * sizeof(int)) == 0) {
+      sequences[i].count += n;
+      return;
+    }
+  if (count == MAX_SEQUENCES) {
+    fprintf(stderr, "Too many distinct sequences\n");
+    exit(-1);
+  }
+  sequences[count].length = length;
+  memcpy(sequences[count].ops, ops, length * sizeof(int));
+  sequences[count].count = n;
+  count++;
+}
+
+/* Only the final instruction of a sequence may transfer control */
+int fusable(struct sequence *s)
+{
+  int i;
+  for (i = 0; i < s->length - 1; i++)
+    if (opcodes[s->ops[i]].last)
+      return 0;
+  return 1;
+}
+
+void load(char *name)
+{
+  FILE *fp;
+  char line[256], *token;
+  unsigned long long n;
+  int length, ops[3], op;
+
+  if ((fp = fopen(name, "r")) == NULL)
+  {
+    fprintf(stderr, "Sorry, but I couldn't open %s\n", name);
+    exit(-1);
+  }
+  while (fgets(line, sizeof(line), fp) != NULL)
+  {
+    if ((token = strtok(line, " \t\n")) == NULL || token[0] == '#')
+      continue;
+    n = strtoull(token, NULL, 10);
+    for (length = 0; (token = strtok(NULL, " \t\n")) != NULL; length++)
+    {
+      if (length == 3 || (op = lookup(token)) < 0)
+        break;
+      ops[length] = op;
+    }
+    if (token == NULL && length >= 2)
+      add(length, ops, n);
+  }
+  fclose(fp);
+}
+
+/* Longest sequences first, so they are matched before their prefixes */
+int order(const void *a, const void *b)
+{
+  const struct sequence *x = a, *y = b;
+  if (x->length != y->length)
+    return y->length - x->length;
+  return (y->score > x->score) - (y->score < x->score);
+}
+
+int by_score(const void *a, const void *b)
+{
+  const struct sequence *x = a, *y = b;
+  return (y->score > x->score) - (y->score < x->score);
+}
+
+int main(int argc, char **argv)
+{
+  int i, j, wanted = 32, fused = 0, span = 2, cells;
+
+  for (i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+      wanted = atoi(argv[++i]);
+    else
+      load(argv[i]);
+  }
+  if (wanted > MAX_FUSED)
+    wanted = MAX_FUSED;
+
+  /* Each fused handler saves length - 1 dispatches per execution */
+  for (i = 0; i < count; i++)
+    sequences[i].score = fusable(&sequences[i]) ?
+                         sequences[i].count * (sequences[i].length - 1) : 0;
+  qsort(sequences, count, sizeof(struct sequence), by_score);
+  for (fused = 0; fused < count && fused < wanted; fused++)
+    if (sequences[fused].score == 0)
+      break;
+  qsort(sequences, fused, sizeof(struct sequence), order);
+
+  for (i = 0; i < fused; i++)
+  {
+    for (cells = j = 0; j < sequences[i].length; j++)
+      cells += 1 + opcodes[sequences[i].ops[j]].operand;
+    if (cells > span)
+      span = cells;
+  }
+
+  printf("/* Fused Instructions ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
+  printf("   Generated by tools/fuse.c from opcode profiles recorded with\n");
+  printf("   'retro --ngrams'. Do not edit; see 'make fusion' instead.\n");
+  printf("   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */\n");
+  printf("#define FUSED_COUNT %d\n", fused);
+  printf("#define FUSED_SPAN  %d\n\n", span);
+
+  printf("static const int rxFusedPatterns[FUSED_COUNT + 1][4] = {\n");
+  for (i = 0; i < fused; i++)
+  {
+    printf("  { %d", sequences[i].length);
+    for (j = 0; j < 3; j++)
+      if (j < sequences[i].length)
+        printf(", VM_%s", opcodes[sequences[i].ops[j]].id);
+      else
+        printf(", 0");
+    printf(" },  /* %llu */\n", sequences[i].count);
+  }
+  printf("  { 0 }\n};\n\n");
+
+  printf("#define FUSED_LABELS \\\n");
+  for (i = 0; i < fused; i++)
+    printf("  &&fused_%d,%s\n", i, (i + 1 < fused) ? " \\" : "");
+  printf("\n");
+
+  printf("#define FUSED_HANDLERS \\\n");
+  for (i = 0; i < fused; i++)
+  {
+    printf("  fused_%d:", i);
+    for (j = 0; j < sequences[i].length; j++)
+      printf(" DO_%s%s", opcodes[sequences[i].ops[j]].id,
+             (j + 1 < sequences[i].length) ? " IP++;" : "");
+    printf(" NEXT%s\n", (i + 1 < fused) ? " \\" : "");
+  }
+  printf("\n");
+  return 0;
+}
@@ -0,0 +1,418 @@
+/******************************************************
+ * Translate a retroImage to C, for building a VM that
+ * runs the code in the image natively.
+ *
+ *   ./translate [retroImage] >native.c
+ *   cc -O2 -Ivm/complete native.c -o retro-native
+ *
+ * The translation unit includes vm/complete/retro.c,
+ * so the binary has the same options and devices as
+ * retro. Code is found by walking from the boot vector
+ * and the xt of each word in the dictionary. Anything
+ * else (code compiled later, computed calls to code
+ * not found by the walk) is left to the interpreter,
+ * and a store to translated code switches back to the
+ * interpreter for the rest of the run.
+ *
+ * Only 32-bit little endian images are supported.
+ ******************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define IMAGE_SIZE 1000000
+
+enum { NOP, LIT, DUP, DROP, SWAP, PUSH, POP, LOOP, JUMP, RETURN, GT_JUMP,
+       LT_JUMP, NE_JUMP, EQ_JUMP, FETCH, STORE, ADD, SUB, MUL, DIVMOD, AND,
+       OR, XOR, SHL, SHR, ZERO_EXIT, INC, DEC, IN, OUT, WAIT, CALL };
+
+int32_t image[IMAGE_SIZE];
+int cells;
+
+/* reached: an instruction starts here, entry: the interpreter may enter
+   native code here, label: native code jumps here, covered: the
+   translation depends on this cell */
+char reached[IMAGE_SIZE], entry[IMAGE_SIZE], label[IMAGE_SIZE];
+char covered[IMAGE_SIZE];
+int work[IMAGE_SIZE], pending;
+int32_t quote, string;
+
+int load_image(char *name)
+{
+  FILE *fp;
+  int x;
+
+  if ((fp = fopen(name, "rb")) == NULL)
+  {
+    fprintf(stderr, "Sorry, but I couldn't open %s\n", name);
+    exit(-1);
+  }
+  x = fread(image, sizeof(int32_t), IMAGE_SIZE, fp);
+  fclose(fp);
+  return x;
+}
+
+int opcode(int32_t x)
+{
+  return (x >= 0 && x < CALL) ? x : CALL;
+}
+
+int length(int32_t x)
+{
+  switch (opcode(x))
+  {
+    case LIT: case LOOP: case JUMP: case GT_JUMP:
+    case LT_JUMP: case NE_JUMP: case EQ_JUMP: return 2;
+    default: return 1;
+  }
+}
+
+/* Returns the xt of the named word, or 0. Headers are linked from
+   'last' (cell 2) and hold link, class, xt and the name. */
+int32_t lookup(char *name)
+{
+  int32_t d, i;
+  char *s;
+
+  for (d = image[2]; d > 0 && d + 3 < cells; d = image[d])
+  {
+    for (i = d + 3, s = name; *s && i < cells && image[i] == *s; i++, s++)
+      ;
+    if (*s == 0 && i < cells && image[i] == 0)
+      return image[d + 2];
+  }
+  return 0;
+}
+
+int valid(int32_t a)
+{
+  return a >= 0 && a < cells;
+}
+
+void reach(int32_t a)
+{
+  if (valid(a) && !reached[a])
+  {
+    reached[a] = 1;
+    work[pending++] = a;
+  }
+}
+
+void enter(int32_t a)
+{
+  if (valid(a))
+  {
+    entry[a] = 1;
+    reach(a);
+  }
+}
+
+void branch(int32_t a)
+{
+  if (valid(a))
+  {
+    label[a] = 1;
+    reach(a);
+  }
+}
+
+/* Follows the code from each root. Calls continue after the call,
+   except for the runtime of quotes and strings, which return past the
+   data following the call. */
+void walk()
+{
+  int32_t p, x, q;
+
+  while (pending > 0)
+  {
+    p = work[--pending];
+    x = image[p];
+    covered[p] = 1;
+    if (length(x) == 2)
+    {
+      if (p + 1 >= cells)
+      {
+        reached[p] = 0;
+        continue;
+      }
+      covered[p + 1] = 1;
+    }
+    switch (opcode(x))
+    {
+      case LOOP: case GT_JUMP: case LT_JUMP: case NE_JUMP: case EQ_JUMP:
+        branch(image[p + 1]);
+        reach(p + 2);
+        break;
+      case JUMP:
+        branch(image[p + 1]);
+        break;
+      case RETURN:
+        break;
+      case CALL:
+        enter(x);
+        branch(x);
+        if (x == quote && valid(p + 1))
+        {
+          enter(p + 2);
+          enter(image[p + 1]);
+        }
+        else if (x == string)
+        {
+          for (q = p + 1; valid(q) && image[q] != 0; q++)
+            ;
+          enter(q + 1);
+        }
+        else
+          enter(p + 1);
+        break;
+      default:
+        reach(p + length(x));
+    }
+  }
+}
+
+void roots()
+{
+  int32_t d, data = lookup(".data");
+
+  quote = lookup("quote");
+  string = lookup("string");
+  enter(0);
+  for (d = image[2]; d > 0 && d + 3 < cells; d = image[d])
+    if (image[d + 1] != data)
+      enter(image[d + 2]);
+  walk();
+}
+
+/* Execution skips NOPs after a call or return, so entries are needed
+   past them too */
+void skip_nops()
+{
+  int32_t a;
+  for (a = 0; a + 1 < cells; a++)
+    if (entry[a] && image[a] == NOP && reached[a + 1])
+      entry[a + 1] = 1;
+}
+
+/* Returns the address of the next instruction emitted after p */
+int32_t following(int32_t p)
+{
+  for (p++; p < cells; p++)
+    if (reached[p])
+      return p;
+  return -1;
+}
+
+/* Instructions falling through to one not emitted right after them
+   need a goto */
+void fallthrough()
+{
+  int32_t p, x;
+  for (p = 0; p < cells; p++)
+  {
+    if (!reached[p])
+      continue;
+    x = opcode(image[p]);
+    if (x == JUMP || x == RETURN || x == CALL)
+      continue;
+    if (valid(p + length(image[p])) && following(p) != p + length(image[p]))
+      label[p + length(image[p])] = 1;
+  }
+}
+
+/* Code transferring control to a (the next instruction run is a + 1 for
+   interpreter addresses) */
+void go(int32_t a)
+{
+  if (valid(a) && reached[a])
+    printf("goto L%d;", a);
+  else if (a - 1 < -1 || a - 1 >= IMAGE_SIZE)
+    printf("goto halt;");
+  else
+    printf("EXIT(%d)", a - 1);
+}
+
+/* The jump is checked before the values are dropped */
+void conditional(int32_t p, char *test)
+{
+  int32_t a = image[p + 1];
+
+  if (!valid(a) && (a - 1 < -1 || a - 1 >= IMAGE_SIZE))
+    printf("if (%s) goto halt; DROP DROP", test);
+  else
+  {
+    printf("if (%s) { DROP DROP ", test);
+    go(a);
+    printf(" } DROP DROP");
+  }
+}
+
+void instruction(int32_t p)
+{
+  int32_t x = image[p];
+
+  switch (opcode(x))
+  {
+    case NOP:       break;
+    case LIT:       printf("DUP tos = %d;", image[p + 1]); break;
+    case DUP:       printf("DUP"); break;
+    case DROP:      printf("DROP"); break;
+    case SWAP:      printf("a = tos; tos = NOS; NOS = a;"); break;
+    case PUSH:      printf("address[++rsp] = tos; DROP"); break;
+    case POP:       printf("DUP tos = address[rsp--];"); break;
+    case LOOP:      printf("if (--tos > 0) "); go(image[p + 1]);
+                    printf(" DROP"); break;
+    case JUMP:      if (image[p + 1] < 1)
+                      printf("goto halt;");
+                    else
+                      go(image[p + 1]);
+                    break;
+    case RETURN:    printf("RETURN"); break;
+    case GT_JUMP:   conditional(p, "NOS > tos"); break;
+    case LT_JUMP:   conditional(p, "NOS < tos"); break;
+    case NE_JUMP:   conditional(p, "tos != NOS"); break;
+    case EQ_JUMP:   conditional(p, "tos == NOS"); break;
+    case FETCH:     printf("FETCH"); break;
+    case STORE:     printf("STORE(%d)", p); break;
+    case ADD:       printf("a = tos; DROP tos += a;"); break;
+    case SUB:       printf("a = tos; DROP tos -= a;"); break;
+    case MUL:       printf("a = tos; DROP tos *= a;"); break;
+    case DIVMOD:    printf("a = tos; b = NOS; tos = b / a; NOS = b %% a;");
+                    break;
+    case AND:       printf("a = tos; DROP tos &= a;"); break;
+    case OR:        printf("a = tos; DROP tos |= a;"); break;
+    case XOR:       printf("a = tos; DROP tos ^= a;"); break;
+    case SHL:       printf("a = tos; DROP tos <<= a;"); break;
+    case SHR:       printf("a = tos; DROP tos >>= a;"); break;
+    case ZERO_EXIT: printf("ZERO_EXIT"); break;
+    case INC:       printf("tos += 1;"); break;
+    case DEC:       printf("tos -= 1;"); break;
+    case IN:        printf("IN"); break;
+    case OUT:       printf("OUT"); break;
+    case WAIT:      printf("WAIT(%d)", p); break;
+    case CALL:      printf("address[++rsp] = %d; ", p);
+                    if (x < 1)
+                      printf("goto halt;");
+                    else
+                      go(x);
+                    break;
+  }
+}
+
+char *names[] = {
+  "NOP", "LIT", "DUP", "DROP", "SWAP", "PUSH", "POP", "LOOP", "JUMP",
+  "RETURN", ">JUMP", "<JUMP", "!JUMP", "=JUMP", "FETCH", "STORE", "ADD",
+  "SUB", "MUL", "DIVMOD", "AND", "OR", "XOR", "SHL", "SHR", "0;", "INC",
+  "DEC", "IN", "OUT", "WAIT", "CALL" };
+
+void table(char *name, char *set)
+{
+  int32_t a, start, n = 0;
+
+  printf("const CELL %s[] = {", name);
+  for (a = 0; a < cells; a++)
+  {
+    if (!set[a] || (a > 0 && set[a - 1]))
+      continue;
+    for (start = a; a < cells && set[a]; a++)
+      ;
+    printf("%s%d, %d,", (n++ % 6) ? " " : "\n  ", start, a - start);
+  }
+  printf("\n  0, 0\n};\n\n");
+}
+
+void emit(char *name)
+{
+  int32_t p, n = 0;
+
+  printf("/* Generated by tools/translate.c from %s. Do not edit. */\n", name);
+  printf("#define RXAOT\n#include \"retro.c\"\n\n");
+
+  table("rxAotCovered", covered);
+  table("rxAotEntries", entry);
+
+  printf("const CELL rxAotCells[] = {");
+  for (p = 0; p < cells; p++)
+    if (covered[p])
+      printf("%s%d,", (n++ % 10) ? " " : "\n  ", image[p]);
+  printf("\n  0\n};\n\n");
+
+  printf("#undef DROP\n#undef NOS\n");
+  printf("#define NOS  data[sp - 1]\n");
+  printf("#define DUP  { sp++; NOS = tos; }\n");
+  printf("#define DROP { if (--sp < 0) { sp = 0; goto halt; } tos = data[sp]; }\n");
+  printf("#define SPILL { vm->ip = ip; vm->sp = sp; vm->rsp = rsp; data[sp] = tos; }\n");
+  printf("#define FILL  { ip = vm->ip; sp = vm->sp; rsp = vm->rsp; tos = data[sp]; }\n");
+  printf("#define EXIT(x) { ip = (x); goto leave; }\n");
+  printf("#define RETURN { ip = address[rsp--]; \\\n"
+         "                 if (ip < 0 || ip >= MAX_IMAGE_SIZE) goto halt; \\\n"
+         "                 goto dispatch; }\n");
+  printf("#define ZERO_EXIT if (tos == 0) { DROP ip = address[rsp]; \\\n"
+         "                 if (ip < -1 || ip >= MAX_IMAGE_SIZE) goto halt; \\\n"
+         "                 rsp--; goto dispatch; }\n");
+  printf("#define FETCH { tos = (tos >= 0 && tos < vm->image_size) ? \\\n"
+         "                  image[tos] : 0; }\n");
+  printf("#define STORE(p) { if (tos >= 0 && tos < vm->store_limit) { \\\n"
+         "                     rxInvalidate(vm, tos, NOS); image[tos] = NOS; } \\\n"
+         "                   else rxStoreOutside(vm, tos, NOS); \\\n"
+         "                   DROP DROP if (!vm->aot) EXIT(p) }\n");
+  printf("#define IN   { tos = rxPortIn(vm, tos); vm->ports[3] = 1; }\n");
+  printf("#define OUT  { rxPortOut(vm, tos, NOS); vm->ports[3] = 1; \\\n"
+         "               DROP DROP }\n");
+  printf("#define WAIT(p) { ip = (p); SPILL rxDeviceHandler(vm); FILL \\\n"
+         "                  vm->ports[3] = 1; if (ip != (p) || !vm->aot) goto leave; }\n\n");
+
+  printf("void rxAotRun(VM *vm) {\n");
+  printf("  CELL a, b, ip, sp, rsp, tos;\n");
+  printf("  CELL *data = vm->data, *address = vm->address, *image = vm->image;\n\n");
+  printf("  FILL\n");
+  printf("dispatch:\n");
+  printf("  switch (ip + 1) {\n");
+  printf("  default: goto leave;\n");
+  for (p = 0; p < cells; p++)
+  {
+    if (!reached[p])
+      continue;
+    if (entry[p])
+      printf("  case %d:\n", p);
+    if (label[p])
+      printf("  L%d:\n", p);
+    printf("    /* %d: %s */", p, names[opcode(image[p])]);
+    if (image[p] != NOP)
+      printf(" ");
+    instruction(p);
+    printf("\n");
+    if (opcode(image[p]) != JUMP && opcode(image[p]) != RETURN &&
+        opcode(image[p]) != CALL && following(p) != p + length(image[p]))
+    {
+      printf("    ");
+      go(p + length(image[p]));
+      printf("\n");
+    }
+  }
+  printf("  }\n");
+  printf("halt:\n");
+  printf("  ip = MAX_IMAGE_SIZE;\n");
+  printf("leave:\n");
+  printf("  SPILL\n");
+  printf("}\n");
+}
+
+int main(int argc, char **argv)
+{
+  char *name = (argc > 1) ? argv[1] : "retroImage";
+
+  cells = load_image(name);
+  if (cells < 4)
+  {
+    fprintf(stderr, "%s is not a Retro image\n", name);
+    exit(-1);
+  }
+  roots();
+  skip_nops();
+  fallthrough();
+  emit(name);
+  return 0;
+}
@@ -0,0 +1,111 @@
+/* Fused Instructions ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   Generated by tools/fuse.c from opcode profiles recorded with
+   'retro --ngrams'. Do not edit; see 'make fusion' instead.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+#define FUSED_COUNT 32
+#define FUSED_SPAN  4
+
+static const int rxFusedPatterns[FUSED_COUNT + 1][4] = {
+  { 3, VM_DEC, VM_PUSH, VM_RETURN },  /* 21586742 */
+  { 3, VM_SWAP, VM_PUSH, VM_CALL },  /* 15871412 */
+  { 3, VM_PUSH, VM_DUP, VM_CALL },  /* 10191710 */
+  { 3, VM_DUP, VM_FETCH, VM_DEC },  /* 5608039 */
+  { 3, VM_PUSH, VM_INC, VM_RETURN },  /* 5608039 */
+  { 3, VM_POP, VM_INC, VM_DUP },  /* 5608039 */
+  { 3, VM_FETCH, VM_DEC, VM_PUSH },  /* 5608039 */
+  { 3, VM_INC, VM_DUP, VM_FETCH },  /* 5608039 */
+  { 3, VM_DEC, VM_PUSH, VM_INC },  /* 5608039 */
+  { 3, VM_LIT, VM_XOR, VM_RETURN },  /* 3689116 */
+  { 3, VM_POP, VM_SWAP, VM_RETURN },  /* 3382706 */
+  { 3, VM_DUP, VM_POP, VM_SWAP },  /* 3380706 */
+  { 3, VM_PUSH, VM_DUP, VM_POP },  /* 3380706 */
+  { 2, VM_DEC, VM_PUSH, 0 },  /* 27194781 */
+  { 2, VM_PUSH, VM_RETURN, 0 },  /* 21586742 */
+  { 2, VM_POP, VM_RETURN, 0 },  /* 15912422 */
+  { 2, VM_SWAP, VM_PUSH, 0 },  /* 15883517 */
+  { 2, VM_PUSH, VM_CALL, 0 },  /* 15871412 */
+  { 2, VM_PUSH, VM_DUP, 0 },  /* 13572416 */
+  { 2, VM_DUP, VM_CALL, 0 },  /* 12384810 */
+  { 2, VM_LIT, VM_CALL, 0 },  /* 11963813 */
+  { 2, VM_POP, VM_LOOP, 0 },  /* 10191710 */
+  { 2, VM_LIT, VM_RETURN, 0 },  /* 6083353 */
+  { 2, VM_DUP, VM_FETCH, 0 },  /* 5648039 */
+  { 2, VM_INC, VM_RETURN, 0 },  /* 5648039 */
+  { 2, VM_PUSH, VM_INC, 0 },  /* 5608039 */
+  { 2, VM_POP, VM_INC, 0 },  /* 5608039 */
+  { 2, VM_FETCH, VM_DEC, 0 },  /* 5608039 */
+  { 2, VM_INC, VM_DUP, 0 },  /* 5608039 */
+  { 2, VM_LIT, VM_XOR, 0 },  /* 3689116 */
+  { 2, VM_XOR, VM_RETURN, 0 },  /* 3689116 */
+  { 2, VM_POP, VM_SWAP, 0 },  /* 3538834 */
+  { 0 }
+};
+
+#define FUSED_LABELS \
+  &&fused_0, \
+  &&fused_1, \
+  &&fused_2, \
+  &&fused_3, \
+  &&fused_4, \
+  &&fused_5, \
+  &&fused_6, \
+  &&fused_7, \
+  &&fused_8, \
+  &&fused_9, \
+  &&fused_10, \
+  &&fused_11, \
+  &&fused_12, \
+  &&fused_13, \
+  &&fused_14, \
+  &&fused_15, \
+  &&fused_16, \
+  &&fused_17, \
+  &&fused_18, \
+  &&fused_19, \
+  &&fused_20, \
+  &&fused_21, \
+  &&fused_22, \
+  &&fused_23, \
+  &&fused_24, \
+  &&fused_25, \
+  &&fused_26, \
+  &&fused_27, \
+  &&fused_28, \
+  &&fused_29, \
+  &&fused_30, \
+  &&fused_31,
+
+#define FUSED_HANDLERS \
+  fused_0: DO_DEC IP++; DO_PUSH IP++; DO_RETURN NEXT \
+  fused_1: DO_SWAP IP++; DO_PUSH IP++; DO_CALL NEXT \
+  fused_2: DO_PUSH IP++; DO_DUP IP++; DO_CALL NEXT \
+  fused_3: DO_DUP IP++; DO_FETCH IP++; DO_DEC NEXT \
+  fused_4: DO_PUSH IP++; DO_INC IP++; DO_RETURN NEXT \
+  fused_5: DO_POP IP++; DO_INC IP++; DO_DUP NEXT \
+  fused_6: DO_FETCH IP++; DO_DEC IP++; DO_PUSH NEXT \
+  fused_7: DO_INC IP++; DO_DUP IP++; DO_FETCH NEXT \
+  fused_8: DO_DEC IP++; DO_PUSH IP++; DO_INC NEXT \
+  fused_9: DO_LIT IP++; DO_XOR IP++; DO_RETURN NEXT \
+  fused_10: DO_POP IP++; DO_SWAP IP++; DO_RETURN NEXT \
+  fused_11: DO_DUP IP++; DO_POP IP++; DO_SWAP NEXT \
+  fused_12: DO_PUSH IP++; DO_DUP IP++; DO_POP NEXT \
+  fused_13: DO_DEC IP++; DO_PUSH NEXT \
+  fused_14: DO_PUSH IP++; DO_RETURN NEXT \
+  fused_15: DO_POP IP++; DO_RETURN NEXT \
+  fused_16: DO_SWAP IP++; DO_PUSH NEXT \
+  fused_17: DO_PUSH IP++; DO_CALL NEXT \
+  fused_18: DO_PUSH IP++; DO_DUP NEXT \
+  fused_19: DO_DUP IP++; DO_CALL NEXT \
+  fused_20: DO_LIT IP++; DO_CALL NEXT \
+  fused_21: DO_POP IP++; DO_LOOP NEXT \
+  fused_22: DO_LIT IP++; DO_RETURN NEXT \
+  fused_23: DO_DUP IP++; DO_FETCH NEXT \
+  fused_24: DO_INC IP++; DO_RETURN NEXT \
+  fused_25: DO_PUSH IP++; DO_INC NEXT \
+  fused_26: DO_POP IP++; DO_INC NEXT \
+  fused_27: DO_FETCH IP++; DO_DEC NEXT \
+  fused_28: DO_INC IP++; DO_DUP NEXT \
+  fused_29: DO_LIT IP++; DO_XOR NEXT \
+  fused_30: DO_XOR IP++; DO_RETURN NEXT \
+  fused_31: DO_POP IP++; DO_SWAP NEXT
+
@@ -0,0 +1,826 @@
+/* Ngaro VM ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   Copyright (c) 2008 - 2011, Charles Childers
+   Copyright (c) 2009 - 2010, Luke Parrish
+   Copyright (c) 2010,        Marc Simpson
+   Copyright (c) 2010,        Jay Skeer
+   Copyright (c) 2011,        Kenneth Keating
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+#ifndef NGARO_HPP
+#define NGARO_HPP
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+
+/* Configuration ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   This is the reference engine of retro.c as a template, so one binary
+   can run images of any cell size and byte order (see retro.cpp). An
+   Engine is specialized on:
+
+     Cell   int16_t, int32_t or int64_t
+     Order  Little or Big, the byte order of the image file
+     Stats  NoStats, or Stats to count opcodes and stack depths
+     Checks Unchecked, or Checked to halt with a message on stack
+            overflow and underflow, bad addresses, negative ports and
+            division by zero instead of running on
+     Trace  NoTrace, or Trace to log each instruction to stderr
+
+   Policies that are off are empty, so the compiler removes them.
+
+   The sizes match retro.c: 16-bit images get 32000 cells, the others
+   1000000.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+namespace ngaro {
+
+enum { ADDRESSES = 1024, STACK_DEPTH = 128, PORTS = 12,
+       MAX_OPEN_FILES = 8, MAX_REQUEST_LENGTH = 1024,
+       CONSOLE_BUFFER = 4096, OUTPUT_BUFFER = 262144 };
+
+enum Opcode { VM_NOP, VM_LIT, VM_DUP, VM_DROP, VM_SWAP, VM_PUSH, VM_POP,
+              VM_LOOP, VM_JUMP, VM_RETURN, VM_GT_JUMP, VM_LT_JUMP,
+              VM_NE_JUMP, VM_EQ_JUMP, VM_FETCH, VM_STORE, VM_ADD,
+              VM_SUB, VM_MUL, VM_DIVMOD, VM_AND, VM_OR, VM_XOR, VM_SHL,
+              VM_SHR, VM_ZERO_EXIT, VM_INC, VM_DEC, VM_IN, VM_OUT,
+              VM_WAIT, NUM_OPS };
+#define VM_CALL NUM_OPS
+
+static const char *opNames[NUM_OPS + 1] = {
+  "NOP", "LIT", "DUP", "DROP", "SWAP", "PUSH", "POP", "LOOP", "JUMP",
+  "RETURN", ">JUMP", "<JUMP", "!JUMP", "=JUMP", "FETCH", "STORE", "ADD",
+  "SUB", "MUL", "DIVMOD", "AND", "OR", "XOR", "SHL", "SHR", "0;", "INC",
+  "DEC", "IN", "OUT", "WAIT", "CALL" };
+
+/* Values each instruction takes from the data stack */
+static const int opArity[NUM_OPS + 1] = {
+  0, 0, 0, 1, 2, 1, 0, 1, 0, 0, 2, 2, 2, 2, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+  2, 1, 1, 1, 1, 2, 0, 0 };
+
+inline int opClass(int64_t opcode) {
+  return (opcode >= 0 && opcode < NUM_OPS) ? (int)opcode : VM_CALL;
+}
+
+/* Byte Order ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+struct Little {
+  enum { id = 0 };
+  template <typename Cell> static Cell get(const unsigned char *p) {
+    uint64_t x = 0;
+    for (int i = sizeof(Cell) - 1; i >= 0; i--)
+      x = (x << 8) | p[i];
+    return (Cell)x;
+  }
+  template <typename Cell> static void put(unsigned char *p, Cell c) {
+    uint64_t x = (uint64_t)(int64_t)c;
+    for (unsigned i = 0; i < sizeof(Cell); i++, x >>= 8)
+      p[i] = (unsigned char)x;
+  }
+};
+
+struct Big {
+  enum { id = 1 };
+  template <typename Cell> static Cell get(const unsigned char *p) {
+    uint64_t x = 0;
+    for (unsigned i = 0; i < sizeof(Cell); i++)
+      x = (x << 8) | p[i];
+    return (Cell)x;
+  }
+  template <typename Cell> static void put(unsigned char *p, Cell c) {
+    uint64_t x = (uint64_t)(int64_t)c;
+    for (int i = sizeof(Cell) - 1; i >= 0; i--, x >>= 8)
+      p[i] = (unsigned char)x;
+  }
+};
+
+/* Policies ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+struct NoStats {
+  void count(int64_t) {}
+  void depths(int64_t, int64_t) {}
+  int level() { return 0; }
+  uint64_t counter(int64_t) { return 0; }
+  void report() {}
+};
+
+struct Stats {
+  uint64_t ops[NUM_OPS + 1];
+  int64_t max_sp, max_rsp;
+  Stats() : max_sp(0), max_rsp(0) { memset(ops, 0, sizeof(ops)); }
+  void count(int64_t opcode) { ops[opClass(opcode)]++; }
+  void depths(int64_t sp, int64_t rsp) {
+    if (max_sp < sp)
+      max_sp = sp;
+    if (max_rsp < rsp)
+      max_rsp = rsp;
+  }
+  int level() { return 1; }
+  /* As capability query -17: opcodes, then max SP, max RSP and total */
+  uint64_t counter(int64_t n) {
+    uint64_t total = 0;
+    if (n >= 0 && n <= NUM_OPS)
+      return ops[n];
+    if (n == NUM_OPS + 1)
+      return max_sp;
+    if (n == NUM_OPS + 2)
+      return max_rsp;
+    if (n == NUM_OPS + 3)
+      for (int i = 0; i < NUM_OPS; i++)
+        total += ops[i];
+    return total;
+  }
+  void report() {
+    uint64_t total = 0;
+    printf("Runtime Statistics\n");
+    for (int i = 0; i <= NUM_OPS; i++) {
+      printf("%s:%*s%llu\n", opNames[i], (int)(8 - strlen(opNames[i])), "",
+             (unsigned long long)ops[i]);
+      if (i < NUM_OPS)
+        total += ops[i];
+    }
+    printf("Max SP:  %lld\n", (long long)max_sp);
+    printf("Max RSP: %lld\n", (long long)max_rsp);
+    printf("Total opcodes processed: %llu\n", (unsigned long long)total);
+  }
+};
+
+struct Unchecked {
+  enum { on = 0 };
+};
+
+struct Checked {
+  enum { on = 1 };
+};
+
+struct NoTrace {
+  template <typename Cell>
+  void step(Cell, Cell, Cell, Cell, Cell) {}
+};
+
+struct Trace {
+  template <typename Cell>
+  void step(Cell ip, Cell opcode, Cell sp, Cell rsp, Cell tos) {
+    fprintf(stderr, "%8lld %-6s sp=%lld rsp=%lld tos=%lld\n", (long long)ip,
+            opNames[opClass(opcode)], (long long)sp, (long long)rsp,
+            (long long)tos);
+  }
+};
+
+/* Host ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   The state that does not depend on the cell size: the image file,
+   the input stack, open files and the terminal.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+struct Host {
+  std::string filename;
+  bool shrink;
+  std::vector<FILE *> input;
+  FILE *files[MAX_OPEN_FILES];
+  struct termios new_termios, old_termios;
+
+  Host() : filename("retroImage"), shrink(false) {
+    input.push_back(stdin);
+    memset(files, 0, sizeof(files));
+  }
+
+  void include(const char *name) {
+    FILE *file;
+    if ((file = fopen(name, "r")))
+      input.push_back(file);
+  }
+
+  int readConsole() {
+    int c;
+    if (input.back() == stdin)
+      fflush(stdout);
+    if ((c = getc(input.back())) == EOF && input.back() != stdin) {
+      fclose(input.back());
+      input.pop_back();
+      c = 0;
+    }
+    if (c == EOF && input.back() == stdin)
+      exit(0);
+    return c;
+  }
+
+  void writeConsole(int64_t c) {
+    (c > 0) ? putchar((char)c) : printf("\033[2J\033[1;1H");
+    /* Erase the previous character if c = backspace */
+    if (c == 8) {
+      putchar(32);
+      putchar(8);
+    }
+  }
+
+  /* As in retro.c, output not going to a terminal is fully buffered */
+  void prepareOutput() {
+    static char buffer[OUTPUT_BUFFER];
+
+    if (!isatty(1))
+      setvbuf(stdout, buffer, _IOFBF, OUTPUT_BUFFER);
+    tcgetattr(0, &old_termios);
+    new_termios = old_termios;
+    new_termios.c_iflag &= ~(BRKINT+ISTRIP+IXON+IXOFF);
+    new_termios.c_iflag |= (IGNBRK+IGNPAR);
+    new_termios.c_lflag &= ~(ICANON+ISIG+IEXTEN+ECHO);
+    new_termios.c_cc[VMIN] = 1;
+    new_termios.c_cc[VTIME] = 0;
+    tcsetattr(0, TCSANOW, &new_termios);
+  }
+
+  void restoreIO() {
+    tcsetattr(0, TCSANOW, &old_termios);
+  }
+
+  int freeFile() {
+    for (int i = 1; i < MAX_OPEN_FILES; i++)
+      if (files[i] == 0)
+        return i;
+    return 0;
+  }
+};
+
+/* Engine ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+template <typename Cell, typename Order, typename StatsPolicy = NoStats,
+          typename Checks = Unchecked, typename TracePolicy = NoTrace>
+class Engine {
+public:
+  enum { CELLSIZE = sizeof(Cell) * 8,
+         IMAGE_SIZE = sizeof(Cell) == 2 ? 32000 : 1000000 };
+
+  Engine(Host &h) : host(h), sp(0), rsp(0), ip(0), image(IMAGE_SIZE) {
+    memset(data, 0, sizeof(data));
+    memset(address, 0, sizeof(address));
+    memset(ports, 0, sizeof(ports));
+  }
+
+  /* Loads an image in this engine's format, returning the cells read */
+  Cell load(const std::vector<unsigned char> &bytes) {
+    size_t i, cells = bytes.size() / sizeof(Cell);
+    if (cells > IMAGE_SIZE)
+      cells = IMAGE_SIZE;
+    for (i = 0; i < cells; i++)
+      image[i] = Order::template get<Cell>(&bytes[i * sizeof(Cell)]);
+    return (Cell)cells;
+  }
+
+  void run() {
+    for (ip = 0; ip < IMAGE_SIZE; ip++)
+      step();
+  }
+
+  StatsPolicy stats;
+  TracePolicy trace;
+
+private:
+  Host &host;
+  Cell sp, rsp, ip;
+  Cell data[STACK_DEPTH];
+  Cell address[ADDRESSES];
+  Cell ports[PORTS];
+  std::vector<Cell> image;
+  char request[MAX_REQUEST_LENGTH + 1];
+
+  Cell &tos()  { return data[sp]; }
+  Cell &nos()  { return data[sp - 1]; }
+  Cell &tors() { return address[rsp]; }
+
+  void drop() {
+    data[sp] = 0;
+    if (--sp < 0) {
+      sp = 0;
+      ip = IMAGE_SIZE;
+    }
+  }
+
+  /* With Checked, stops the VM with a message if ok is false */
+  bool check(bool ok, const char *what) {
+    if (Checks::on && !ok) {
+      fprintf(stderr, "\nNgaro: %s at %lld\n", what, (long long)ip);
+      ip = IMAGE_SIZE;
+      return false;
+    }
+    return true;
+  }
+
+  bool inside(Cell a) {
+    return a >= 0 && a < IMAGE_SIZE;
+  }
+
+  bool checkAddress(Cell a) {
+    return check(inside(a), "address out of range");
+  }
+
+  void skipNops() {
+    if (ip < 0)
+      ip = IMAGE_SIZE;
+    else {
+      if (ip + 1 < IMAGE_SIZE && image[ip + 1] == 0)
+        ip++;
+      if (ip + 1 < IMAGE_SIZE && image[ip + 1] == 0)
+        ip++;
+    }
+  }
+
+  void jumpTo(Cell a) {
+    ip = a - 1;
+  }
+
+  void step() {
+    Cell a, b, opcode = image[ip];
+
+    stats.count(opcode);
+    trace.step(ip, opcode, sp, rsp, data[sp]);
+    if (Checks::on) {
+      if (!check(sp >= 0 && sp < STACK_DEPTH - 1, "data stack overflow") ||
+          !check(rsp >= 0 && rsp < ADDRESSES - 1, "address stack overflow") ||
+          !check(sp >= opArity[opClass(opcode)], "data stack underflow"))
+        return;
+    }
+
+    switch (opClass(opcode)) {
+      case VM_NOP:
+           break;
+      case VM_LIT:
+           sp++;
+           ip++;
+           tos() = image[ip];
+           break;
+      case VM_DUP:
+           sp++;
+           data[sp] = nos();
+           break;
+      case VM_DROP:
+           drop();
+           break;
+      case VM_SWAP:
+           a = tos();
+           tos() = nos();
+           nos() = a;
+           break;
+      case VM_PUSH:
+           rsp++;
+           tors() = tos();
+           drop();
+           break;
+      case VM_POP:
+           if (!check(rsp > 0, "address stack underflow"))
+             break;
+           sp++;
+           tos() = tors();
+           rsp--;
+           break;
+      case VM_LOOP:
+           tos()--;
+           ip++;
+           if (tos() != 0 && tos() > -1)
+             jumpTo(image[ip]);
+           else
+             drop();
+           break;
+      case VM_JUMP:
+           ip++;
+           jumpTo(image[ip]);
+           skipNops();
+           break;
+      case VM_RETURN:
+           if (!check(rsp > 0, "address stack underflow"))
+             break;
+           ip = tors();
+           rsp--;
+           skipNops();
+           break;
+      case VM_GT_JUMP:
+           ip++;
+           if (nos() > tos())
+             jumpTo(image[ip]);
+           drop(); drop();
+           break;
+      case VM_LT_JUMP:
+           ip++;
+           if (nos() < tos())
+             jumpTo(image[ip]);
+           drop(); drop();
+           break;
+      case VM_NE_JUMP:
+           ip++;
+           if (tos() != nos())
+             jumpTo(image[ip]);
+           drop(); drop();
+           break;
+      case VM_EQ_JUMP:
+           ip++;
+           if (tos() == nos())
+             jumpTo(image[ip]);
+           drop(); drop();
+           break;
+      case VM_FETCH:
+           if (checkAddress(tos()))
+             tos() = inside(tos()) ? image[tos()] : 0;
+           break;
+      case VM_STORE:
+           if (checkAddress(tos())) {
+             if (inside(tos()))
+               image[tos()] = nos();
+             drop(); drop();
+           }
+           break;
+      case VM_ADD:
+           nos() += tos();
+           drop();
+           break;
+      case VM_SUB:
+           nos() -= tos();
+           drop();
+           break;
+      case VM_MUL:
+           nos() *= tos();
+           drop();
+           break;
+      case VM_DIVMOD:
+           if (!check(tos() != 0, "division by zero"))
+             break;
+           a = tos();
+           b = nos();
+           tos() = b / a;
+           nos() = b % a;
+           break;
+      case VM_AND:
+           a = tos();
+           b = nos();
+           drop();
+           tos() = a & b;
+           break;
+      case VM_OR:
+           a = tos();
+           b = nos();
+           drop();
+           tos() = a | b;
+           break;
+      case VM_XOR:
+           a = tos();
+           b = nos();
+           drop();
+           tos() = a ^ b;
+           break;
+      case VM_SHL:
+           a = tos();
+           b = nos();
+           drop();
+           tos() = b << a;
+           break;
+      case VM_SHR:
+           a = tos();
+           drop();
+           tos() >>= a;
+           break;
+      case VM_ZERO_EXIT:
+           if (tos() == 0) {
+             drop();
+             ip = tors();
+             rsp--;
+           }
+           break;
+      case VM_INC:
+           tos() += 1;
+           break;
+      case VM_DEC:
+           tos() -= 1;
+           break;
+      case VM_IN:
+           if (!check(tos() >= 0, "negative port"))
+             break;
+           a = tos();
+           tos() = 0;
+           if (a >= 0 && a < PORTS) {
+             tos() = ports[a];
+             ports[a] = 0;
+           }
+           break;
+      case VM_OUT:
+           if (!check(tos() >= 0, "negative port"))
+             break;
+           ports[0] = 0;
+           if (tos() >= 0 && tos() < PORTS)
+             ports[tos()] = nos();
+           drop(); drop();
+           break;
+      case VM_WAIT:
+           devices();
+           break;
+      default:
+           rsp++;
+           tors() = ip;
+           jumpTo(opcode);
+           skipNops();
+           break;
+    }
+    stats.depths(sp, rsp);
+    ports[3] = 1;
+  }
+
+  /* Devices ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+     The baseline ports and requests of rxDeviceHandler() in retro.c:
+     console input and output, port 4's files up to -8, the
+     capability queries and the enhanced console. IN from a port past
+     PORTS reads 0, and OUT to one is dropped.
+
+     The capabilities added since then are reported as missing: queries
+     -20 to -23 (token input, blocks, mapping and port 9) return 0,
+     and -25 returns -1's size, as memory can't grow. Images check
+     these before using them, but if they don't, the requests behind
+     them (token input on port 1, 3 and -9 to -14 on port 4, -24 and
+     port 9) take their arguments and return 0, so the stack stays
+     as it would with retro.c.
+     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+  Cell pop() {
+    Cell x = tos();
+    drop();
+    return x;
+  }
+
+  /* Drops the arguments of a request this engine doesn't support */
+  Cell unsupported(int arguments) {
+    while (arguments-- > 0)
+      pop();
+    return 0;
+  }
+
+  const char *string(Cell at) {
+    int i = 0;
+    while (at >= 0 && at < IMAGE_SIZE && image[at] && i < MAX_REQUEST_LENGTH)
+      request[i++] = (char)image[at++];
+    request[i] = 0;
+    return request;
+  }
+
+  bool validFile(Cell slot) {
+    return check(slot > 0 && slot < MAX_OPEN_FILES && host.files[slot],
+                 "bad file handle");
+  }
+
+  Cell openFile() {
+    static const char *modes[] = { "r", "w", "a", "r+" };
+    Cell slot = host.freeFile(), mode = pop(), name = pop();
+    const char *s = string(name);
+    if (slot > 0 && mode >= 0 && mode <= 3)
+      host.files[slot] = fopen(s, modes[mode]);
+    if (host.files[slot] == NULL) {
+      host.files[slot] = 0;
+      slot = 0;
+    }
+    return slot;
+  }
+
+  Cell readFile() {
+    Cell slot = pop();
+    if (!validFile(slot))
+      return 0;
+    int c = fgetc(host.files[slot]);
+    return (c == EOF) ? 0 : c;
+  }
+
+  Cell writeFile() {
+    Cell slot = pop(), c = pop();
+    if (!validFile(slot))
+      return 0;
+    return (fputc(c, host.files[slot]) == EOF) ? 0 : 1;
+  }
+
+  Cell closeFile() {
+    Cell slot = pop();
+    if (validFile(slot)) {
+      fclose(host.files[slot]);
+      host.files[slot] = 0;
+    }
+    return 0;
+  }
+
+  Cell filePosition() {
+    Cell slot = pop();
+    return validFile(slot) ? (Cell)ftell(host.files[slot]) : 0;
+  }
+
+  Cell setFilePosition() {
+    Cell slot = pop(), pos = pop();
+    return validFile(slot) ? (Cell)fseek(host.files[slot], pos, SEEK_SET) : 0;
+  }
+
+  Cell fileSize() {
+    Cell slot = pop();
+    long current, size;
+    int r;
+    if (!validFile(slot))
+      return 0;
+    current = ftell(host.files[slot]);
+    r = fseek(host.files[slot], 0, SEEK_END);
+    size = ftell(host.files[slot]);
+    fseek(host.files[slot], current, SEEK_SET);
+    return (r == 0) ? (Cell)size : 0;
+  }
+
+  Cell deleteFile() {
+    return (unlink(string(pop())) == 0) ? -1 : 0;
+  }
+
+  void save() {
+    size_t cells = host.shrink ? (size_t)image[3] : (size_t)IMAGE_SIZE;
+    std::vector<unsigned char> bytes(cells * sizeof(Cell));
+    FILE *fp;
+
+    fflush(stdout);
+    if ((fp = fopen(host.filename.c_str(), "wb")) == NULL) {
+      printf("Unable to save the retroImage!\n");
+      host.restoreIO();
+      exit(2);
+    }
+    for (size_t i = 0; i < cells; i++)
+      Order::template put<Cell>(&bytes[i * sizeof(Cell)], image[i]);
+    fwrite(&bytes[0], 1, bytes.size(), fp);
+    fclose(fp);
+  }
+
+  void queryEnvironment() {
+    Cell req = pop(), dest = pop();
+    const char *r = getenv(string(req));
+
+    if (!checkAddress(dest))
+      return;
+    image[dest] = 0;
+    for (; r != 0 && *r != '\0' && dest + 1 < IMAGE_SIZE; r++) {
+      image[dest++] = *r;
+      image[dest] = 0;
+    }
+  }
+
+  /* Bulk console output: characters are gathered in a buffer, with
+     backspace and clearing the screen left to writeConsole(). Zero
+     cells are skipped, as by the kernel's putc. */
+  void writeRange(Cell from, Cell to) {
+    char buffer[CONSOLE_BUFFER];
+    int n = 0;
+
+    if (from < 0)
+      from = 0;
+    if (to > IMAGE_SIZE)
+      to = IMAGE_SIZE;
+    for (; from < to; from++) {
+      Cell c = image[from];
+      if (c > 0 && c != 8) {
+        buffer[n++] = (char)c;
+        if (n == CONSOLE_BUFFER) {
+          fwrite(buffer, 1, n, stdout);
+          n = 0;
+        }
+      } else if (c != 0) {
+        fwrite(buffer, 1, n, stdout);
+        n = 0;
+        host.writeConsole(c);
+      }
+    }
+    fwrite(buffer, 1, n, stdout);
+  }
+
+  void writeString(Cell a) {
+    Cell end = a;
+    if (!checkAddress(a))
+      return;
+    while (end < IMAGE_SIZE && image[end] != 0)
+      end++;
+    writeRange(a, end);
+  }
+
+  void devices() {
+    struct winsize w;
+    Cell a, b;
+    if (ports[0] == 1)
+      return;
+
+    /* Input */
+    if (ports[0] == 0 && ports[1] == 1) {
+      ports[1] = host.readConsole();
+      ports[0] = 1;
+    }
+    if (ports[0] == 0 && ports[1] == 2) {
+      ports[1] = unsupported(3);
+      ports[0] = 1;
+    }
+
+    /* Output (character generator) */
+    if (ports[2] != 0) {
+      switch (ports[2]) {
+        case 1: host.writeConsole(pop());
+                break;
+        case 2: writeString(pop());
+                break;
+        case 3: b = pop();
+                a = pop();
+                writeRange(a, a + b);
+                break;
+        case 4: fflush(stdout);
+                break;
+      }
+      ports[2] = 0;
+      ports[0] = 1;
+    }
+
+    /* File IO and Image Saving */
+    if (ports[4] != 0) {
+      ports[0] = 1;
+      switch (ports[4]) {
+        case  1: save();
+                 ports[4] = 0;
+                 break;
+        case  2: host.include(string(pop()));
+                 ports[4] = 0;
+                 break;
+        case  3: ports[4] = unsupported(0);   break;
+        case -1: ports[4] = openFile();        break;
+        case -2: ports[4] = readFile();        break;
+        case -3: ports[4] = writeFile();       break;
+        case -4: ports[4] = closeFile();       break;
+        case -5: ports[4] = filePosition();    break;
+        case -6: ports[4] = setFilePosition(); break;
+        case -7: ports[4] = fileSize();        break;
+        case -8: ports[4] = deleteFile();      break;
+        case -9:
+        case -10:
+        case -11:
+        case -12: ports[4] = unsupported(3);  break;
+        case -13: ports[4] = unsupported(1);  break;
+        default: ports[4] = 0;
+      }
+    }
+
+    /* Capabilities */
+    if (ports[5] != 0) {
+      ports[0] = 1;
+      switch (ports[5]) {
+        case -1:  ports[5] = IMAGE_SIZE;      break;
+        case -5:  ports[5] = sp;              break;
+        case -6:  ports[5] = rsp;             break;
+        case -8:  ports[5] = (Cell)time(NULL); break;
+        case -9:  ports[5] = 0;
+                  fflush(stdout);
+                  ip = IMAGE_SIZE;
+                  break;
+        case -10: ports[5] = 0;
+                  queryEnvironment();
+                  break;
+        case -11: ioctl(0, TIOCGWINSZ, &w);
+                  ports[5] = w.ws_col;
+                  break;
+        case -12: ioctl(0, TIOCGWINSZ, &w);
+                  ports[5] = w.ws_row;
+                  break;
+        case -13: ports[5] = CELLSIZE;        break;
+        case -14: ports[5] = Order::id;       break;
+        case -15: ports[5] = -1;              break;
+        case -16: ports[5] = stats.level();   break;
+        case -17: ports[5] = (Cell)stats.counter(pop()); break;
+        case -18: pop();
+                  ports[5] = 0;
+                  break;
+        case -19: ports[5] = -1;              break;
+        case -24: pop();
+                  ports[5] = IMAGE_SIZE;
+                  break;
+        case -25: ports[5] = IMAGE_SIZE;      break;
+        default:  ports[5] = 0;
+      }
+    }
+
+    /* Asynchronous file I/O: read, write, open, then poll, wait, result */
+    if (ports[9] != 0) {
+      switch (ports[9]) {
+        case 1:
+        case 2:  ports[9] = unsupported(4); break;
+        case 3:  ports[9] = unsupported(3); break;
+        default: ports[9] = 0;
+      }
+      ports[0] = 1;
+    }
+
+    /* Enhanced console */
+    if (ports[8] != 0) {
+      switch (ports[8]) {
+        case 1: printf("\033[%lld;%lldH", (long long)nos(), (long long)tos());
+                drop(); drop();
+                break;
+        case 2: printf("\033[3%lldm", (long long)tos());
+                drop();
+                break;
+        case 3: printf("\033[4%lldm", (long long)tos());
+                drop();
+                break;
+      }
+      ports[8] = 0;
+    }
+  }
+};
+
+}
+
+#endif
@@ -5,26 +5,47 @@
    Copyright (c) 2010,        Jay Skeer
    Copyright (c) 2011,        Kenneth Keating
    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
 #include <string.h>
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#ifndef RXNOASYNC
+#include <pthread.h>
+#endif
 /* ATH */
 #include <sys/stat.h>
 #include <errno.h>
 
 /* Configuration ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
-                +---------+---------+---------+
-                | 16 bit  | 32 bit  | 64 bit  |
-   +------------+---------+---------+---------+
-   | IMAGE_SIZE | 32000   | 1000000 | 1000000 |
-   +------------+---------+---------+---------+
-   | CELL       | int16_t | int32_t | int64_t |
-   +------------+---------+---------+---------+
+                    +---------+----------+----------+
+                    | 16 bit  | 32 bit   | 64 bit   |
+   +----------------+---------+----------+----------+
+   | IMAGE_SIZE     | 32000   | 1000000  | 1000000  |
+   +----------------+---------+----------+----------+
+   | MAX_IMAGE_SIZE | 32000   | 64000000 | 64000000 |
+   +----------------+---------+----------+----------+
+   | CELL           | int16_t | int32_t  | int64_t  |
+   +----------------+---------+----------+----------+
+
+   IMAGE_SIZE cells of memory are usable at startup. Room is reserved
+   for MAX_IMAGE_SIZE, which the image can grow into at runtime (or
+   with --ram). Hosts with 32 bit pointers only reserve IMAGE_SIZE.
+   The image starts on a HUGE_PAGE boundary, so it can be backed by
+   huge pages with --huge. Saving rewrites the image file in blocks of
+   SAVE_BLOCK bytes, skipping those not stored into since.
 
    If memory is tight, cut the MAX_FILE_NAME and MAX_REQUEST_LENGTH.
 
@@ -32,23 +53,63 @@
    heavy nesting or recursion this may cause problems. If you do modify
    it and experience odd problems, try raising it a bit higher.
 
+   PORTS I/O ports are allocated at startup. Writing to a higher port
+   adds more, up to MAX_PORTS.
+
    Use -DRX16 to select defaults for 16-bit, or -DRX64 to select the
    defaults for 64-bit. Without these, the compiler will generate a
    standard 32-bit VM.
 
    Use -DRXBE to enable the BE suffix for big endian images. This is
    only useful on big endian systems.
+
+   When built with a compiler supporting labels as values (gcc, clang),
+   a direct threaded engine is used by default. The reference switch
+   engine can be selected at runtime with --switch, or forced at build
+   time with -DRXSWITCH.
+
+   On x86-64 Linux the threaded engine can also compile hot code to
+   native instructions when run with --jit. Use -DRXNOJIT to leave the
+   compiler out.
+
+   RXAOT is defined by the C files generated by tools/translate.c, which
+   include this file. Code translated ahead of time is then run by the
+   threaded engine in place of the interpreted code.
+
+   Use -DRXNOASYNC to leave out the asynchronous file device (port 9),
+   which runs requests on threads.
+
+   RXSTATS sets the most instrumentation that can be asked for at
+   runtime: 0 for none, 1 for opcode counts and stack depths (--stats),
+   or 2 to also count opcode pairs, triples and calls to each word
+   (--stats-full, --ngrams). It defaults to 2. Either way, a run without
+   these options uses an engine with no instrumentation at all.
    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
 #define CELL            int32_t
 #define IMAGE_SIZE      1000000
+#if UINTPTR_MAX > 0xffffffff
+#define MAX_IMAGE_SIZE 64000000
+#else
+#define MAX_IMAGE_SIZE  1000000
+#endif
 #define ADDRESSES          1024
 #define STACK_DEPTH         128
 #define PORTS                12
+#define MAX_PORTS          4096
 #define MAX_FILE_NAME      1024
 #define MAX_REQUEST_LENGTH 1024
 #define MAX_OPEN_FILES        8
+#define MAX_MAPPINGS          8
+#define CONSOLE_BUFFER     4096
+#define OUTPUT_BUFFER    262144
+#define FILE_BUFFER       65536
+#define HUGE_PAGE       2097152
+#define SAVE_BLOCK         4096
 #define LOCAL                 "retroImage"
 #define CELLSIZE             32
+#ifndef RXSTATS
+#define RXSTATS               2
+#endif
 
 #ifdef RX64
 #undef CELL
@@ -64,9 +125,11 @@
 #undef CELLSIZE
 #undef LOCAL
 #undef IMAGE_SIZE
+#undef MAX_IMAGE_SIZE
 #define CELL        int16_t
 #define CELLSIZE    16
 #define IMAGE_SIZE  32000
+#define MAX_IMAGE_SIZE 32000
 #define LOCAL       "retroImage16"
 #endif
 
@@ -78,6 +141,21 @@
 #define VM_ENDIAN 0
 #endif
 
+#define SAVE_CELLS (SAVE_BLOCK / sizeof(CELL))
+
+#if defined(__GNUC__) && !defined(RXSWITCH)
+#define RXTHREADED
+#endif
+
+#if defined(RXAOT) && !defined(RXTHREADED)
+#error "Translated images need the threaded engine"
+#endif
+
+#if defined(RXTHREADED) && defined(__x86_64__) && defined(__linux__) && \
+    CELLSIZE == 32 && !defined(RXNOJIT) && !defined(RXAOT)
+#define RXJIT
+#endif
+
 
 enum vm_opcode {VM_NOP, VM_LIT, VM_DUP, VM_DROP, VM_SWAP, VM_PUSH, VM_POP,
                 VM_LOOP, VM_JUMP, VM_RETURN, VM_GT_JUMP, VM_LT_JUMP,
@@ -86,42 +164,332 @@ enum vm_opcode {VM_NOP, VM_LIT, VM_DUP, VM_DROP, VM_SWAP, VM_PUSH, VM_POP,
                 VM_SHR, VM_ZERO_EXIT, VM_INC, VM_DEC, VM_IN, VM_OUT,
                 VM_WAIT };
 #define NUM_OPS VM_WAIT + 1
+#define VM_CALL NUM_OPS       /* Implicit calls, for stats and profiles */
+
+struct rxStack;
+struct rxDevice;
+
+enum vm_stats {STATS_OFF, STATS_COUNTS, STATS_FULL};
+enum vm_hooks {HOOK_JIT = 1, HOOK_SAMPLE = 2};
+
+/* An input source: a file mapped into memory, read from at until end,
+   or a stream read with getc when it can't be mapped (stdin, pipes). */
+struct rxSource {
+  unsigned char *at, *end, *map;
+  size_t size;
+  FILE *file;
+};
 
+/* A file mapped over the image, from start for size bytes, kept open
+   (and locked) in fd */
+struct rxMapping {
+  CELL start, mode;
+  size_t size;
+  int fd;
+};
+
+/* The file an image was last loaded from or saved to, holding its
+   first cells cells */
+struct rxSaved {
+  int known;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  long cells;
+};
+
+/* rxAllocVM() places the VM so that the image starts on a huge page,
+   which lets files and huge pages be mapped over it. */
 typedef struct {
   CELL sp, rsp, ip;
   CELL data[STACK_DEPTH];
   CELL address[ADDRESSES];
-  CELL ports[PORTS];
+  CELL *ports, port_count;
+  struct rxDevice *devices;
+  unsigned long *dirty, *attached;
   FILE *files[MAX_OPEN_FILES];
-  FILE *input[MAX_OPEN_FILES];
+  struct rxSource input[MAX_OPEN_FILES];
   CELL isp;
-  CELL image[IMAGE_SIZE];
+  struct rxMapping maps[MAX_MAPPINGS];
+#ifndef RXNOASYNC
+  struct rxAsync *async;
+#endif
+  CELL image_size, table_size, store_limit;
+  int huge;
+  size_t hugetlb;
+  int image_fd;
+  size_t image_mapped;
+  struct rxSaved saved;
+  unsigned char changed[MAX_IMAGE_SIZE / SAVE_CELLS + 1];
+  unsigned char saving[MAX_IMAGE_SIZE / SAVE_CELLS + 1];
+  pid_t saver;
+  int save_pipe, save_status;
+  CELL image[MAX_IMAGE_SIZE];
   CELL shrink, padding;
-  int stats[NUM_OPS + 1];
-  int max_sp, max_rsp;
+  int level;
+#if RXSTATS > 0
+  uint64_t stats[NUM_OPS + 1];
+  uint64_t max_sp, max_rsp;
+#endif
+#if RXSTATS > 1
+  int ngram_ops[2], ngram_len;
+  CELL ngram_next;
+  uint64_t bigrams[NUM_OPS + 1][NUM_OPS + 1];
+  uint64_t trigrams[NUM_OPS + 1][NUM_OPS + 1][NUM_OPS + 1];
+  uint64_t *calls;
+#endif
+  volatile sig_atomic_t hooks;
+  char *profile;
+  struct rxStack **stacks;
+  uint64_t samples;
   char filename[MAX_FILE_NAME];
   char request[MAX_REQUEST_LENGTH];
   struct termios new_termios, old_termios;
+#ifdef RXTHREADED
+  int32_t *shadow;
+  CELL *target;
+  char *skipped, *examined;
+  CELL decoded;
+  int past_end;
+#endif
+#ifdef RXJIT
+  int jit, jit_active, jit_stale;
+  unsigned char *jit_code;
+  long jit_used, jit_base, jit_exit, jit_halt, jit_underflow, jit_dispatch,
+       jit_return;
+  CELL jit_lo, jit_hi;
+  void **jit_entry;
+  char *jit_covered;
+  int *jit_hits;
+#endif
+#ifdef RXAOT
+  int aot;
+  CELL aot_hi;
+  char *aot_entry, *aot_covered;
+#endif
 } VM;
 
 /* Macros ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
 #define IP   vm->ip
 #define SP   vm->sp
 #define RSP  vm->rsp
-#define DROP { vm->data[SP] = 0; if (--SP < 0) IP = IMAGE_SIZE; }
+#define DROP { vm->data[SP] = 0; if (--SP < 0) { SP = 0; IP = MAX_IMAGE_SIZE; } }
 #define TOS  vm->data[SP]
 #define NOS  vm->data[SP-1]
 #define TORS vm->address[RSP]
+#define CHANGED(a) { if ((a) >= 0 && (a) < MAX_IMAGE_SIZE) \
+                       vm->changed[(a) / SAVE_CELLS] = 1; }
 
 /* Helper Functions ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
 void rxGetString(VM *vm, int starting)
 {
   CELL i = 0;
-  while(vm->image[starting] && i < MAX_REQUEST_LENGTH)
+  while(starting < vm->image_size && vm->image[starting] &&
+        i < MAX_REQUEST_LENGTH)
     vm->request[i++] = (char)vm->image[starting++];
   vm->request[i] = 0;
 }
 
+/* Opcode Helpers ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+const char *rxOpNames[NUM_OPS + 1] = {
+  "NOP", "LIT", "DUP", "DROP", "SWAP", "PUSH", "POP", "LOOP", "JUMP",
+  "RETURN", ">JUMP", "<JUMP", "!JUMP", "=JUMP", "FETCH", "STORE", "ADD",
+  "SUB", "MUL", "DIVMOD", "AND", "OR", "XOR", "SHL", "SHR", "0;", "INC",
+  "DEC", "IN", "OUT", "WAIT", "CALL" };
+
+int rxOpClass(CELL opcode) {
+  return (opcode >= 0 && opcode < NUM_OPS) ? opcode : VM_CALL;
+}
+
+int rxOpLength(CELL opcode) {
+  switch (opcode) {
+    case VM_LIT:     case VM_LOOP:    case VM_JUMP:
+    case VM_GT_JUMP: case VM_LT_JUMP: case VM_NE_JUMP:
+    case VM_EQ_JUMP: return 2;
+    default:         return 1;
+  }
+}
+
+/* Decoded Instruction Cache ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   The threaded engine decodes each instruction once. vm->shadow[] holds
+   the offset of the handler for each address, relative to op_resolve,
+   so a zero entry (the state after calloc or a flush) is decoded on
+   first use. For calls and jumps the destination, with any leading
+   NOPs already skipped, is kept in vm->target[], and the skipped NOPs
+   are flagged in vm->skipped[].
+
+   Anything writing to the image must call rxInvalidate() (VM_STORE) or
+   rxImageWritten() (devices), which also mark the block written to as
+   changed for rxSaveImage(). This drops the entries depending on the
+   written cell: the instruction there and those before it, whose
+   operand or fused sequence it may be part of. If a skipped NOP
+   becomes something else (as done by is, devector, etc) any decoded
+   call or jump may be wrong, so the whole cache is flushed. The same is
+   done for writes to the code examined when deciding on a tail call
+   (see below), flagged in vm->examined[]. vm->decoded
+   bounds the addresses holding cached state, so writes past it (the
+   heap, most of the time) cost nothing more than a compare. Writes to
+   cells translated by the JIT compiler drop all of the native code, and
+   writes to cells translated ahead of time turn that code off.
+
+   Common sequences of instructions are decoded into a single fused
+   handler. The set is generated into fused.h by tools/fuse.c from a
+   profile recorded with --ngrams. A fused entry depends on up to
+   FUSED_SPAN cells, all of which are covered by the invalidation.
+
+   A call followed by a RETURN is decoded as a jump, so it pushes
+   nothing on the address stack, as long as the destination leaves the
+   return address alone. rxTailSafe() checks this by following the code
+   there for up to TAIL_SCAN instructions: it must not POP more than it
+   has PUSHed. Calls made from there are assumed to return normally.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+#ifdef RXTHREADED
+#include "fused.h"
+
+#ifdef RXJIT
+void rxJitFlush(VM *vm);
+#endif
+
+#ifdef RXAOT
+extern const CELL rxAotCovered[], rxAotEntries[], rxAotCells[];
+void rxAotRun(VM *vm);
+#endif
+
+void rxFlushDecoded(VM *vm) {
+  memset(vm->shadow, 0, (vm->decoded + 1) * sizeof(int32_t));
+  memset(vm->skipped, 0, vm->decoded + 1);
+  memset(vm->examined, 0, vm->decoded + 1);
+  vm->decoded = 0;
+}
+
+void rxInvalidate(VM *vm, CELL a, CELL value) {
+  CELL i;
+  CHANGED(a)
+#ifdef RXJIT
+  if (a >= 0 && a < vm->image_size && vm->jit_covered[a])
+    rxJitFlush(vm);
+#endif
+#ifdef RXAOT
+  if (a >= 0 && a < vm->image_size && vm->aot_covered[a])
+    vm->aot = 0;
+#endif
+  if (a < 0 || a > vm->decoded)
+    return;
+  if ((vm->skipped[a] && value != 0) || vm->examined[a]) {
+    rxFlushDecoded(vm);
+    return;
+  }
+  for (i = a; i >= 0 && i > a - FUSED_SPAN; i--)
+    vm->shadow[i] = 0;
+}
+
+/* Returns vm->image_size, where the engine halts, for ip outside the
+   image */
+CELL rxSkipNops(VM *vm, CELL ip) {
+  if (ip < 0 || ip >= vm->image_size) {
+    vm->past_end = 1;
+    return vm->image_size;
+  }
+  if (ip + 1 < vm->image_size && vm->image[ip+1] == 0) {
+    vm->skipped[++ip] = 1;
+    if (ip + 1 < vm->image_size && vm->image[ip+1] == 0)
+      vm->skipped[++ip] = 1;
+  }
+  if (vm->decoded < ip)
+    vm->decoded = ip;
+  return ip;
+}
+
+#define TAIL_SCAN 32
+
+/* Returns nonzero if the code at a leaves the return address on the
+   address stack alone */
+int rxTailSafe(VM *vm, CELL a) {
+  CELL seen[TAIL_SCAN], depth[TAIL_SCAN], work[TAIL_SCAN], wdepth[TAIL_SCAN];
+  int i, op, d, found = 0, pending = 0;
+
+  work[pending] = a;
+  wdepth[pending++] = 0;
+  while (pending > 0) {
+    a = work[--pending];
+    d = wdepth[pending];
+    for (;;) {
+      if (a < 0 || a >= vm->image_size - 1)
+        return 0;
+      for (i = 0; i < found && seen[i] != a; i++)
+        ;
+      if (i < found) {
+        if (depth[i] != d)
+          return 0;
+        break;
+      }
+      if (found == TAIL_SCAN)
+        return 0;
+      seen[found] = a;
+      depth[found++] = d;
+      op = rxOpClass(vm->image[a]);
+      vm->examined[a] = vm->examined[a + 1] = 1;
+      if (vm->decoded < a + 1)
+        vm->decoded = a + 1;
+      if (op == VM_POP && d-- == 0)
+        return 0;
+      if (op == VM_PUSH)
+        d++;
+      if (op == VM_RETURN)
+        break;
+      if (op == VM_JUMP) {
+        a = vm->image[a + 1];
+        continue;
+      }
+      if (op >= VM_LOOP && op <= VM_EQ_JUMP) {
+        if (pending == TAIL_SCAN)
+          return 0;
+        work[pending] = vm->image[a + 1];
+        wdepth[pending++] = d;
+      }
+      a += rxOpLength(op);
+    }
+  }
+  return 1;
+}
+
+/* Returns the address of the last instruction if the code at ip
+   matches a fused pattern, or 0 if not */
+CELL rxMatchFused(VM *vm, CELL ip, const int *pattern) {
+  int i;
+  CELL last = 0;
+  for (i = 1; i <= pattern[0]; i++) {
+    if (ip >= vm->image_size || rxOpClass(vm->image[ip]) != pattern[i])
+      return 0;
+    last = ip;
+    ip += rxOpLength(vm->image[ip]);
+  }
+  return last;
+}
+#endif
+
+void rxImageWritten(VM *vm, CELL start, CELL count) {
+  size_t b;
+#ifdef RXTHREADED
+  CELL i, last = vm->decoded;
+#ifdef RXJIT
+  if (last < vm->jit_hi)
+    last = vm->jit_hi;
+#endif
+#ifdef RXAOT
+  if (last < vm->aot_hi)
+    last = vm->aot_hi;
+#endif
+  for (i = start; i < start + count && i <= last; i++)
+    rxInvalidate(vm, i, vm->image[i]);
+#endif
+  if (start >= 0 && count > 0)
+    for (b = start / SAVE_CELLS; b <= (start + count - 1) / SAVE_CELLS &&
+         b < sizeof(vm->changed); b++)
+      vm->changed[b] = 1;
+}
+
 /* Console I/O Support ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
 void rxWriteConsole(CELL c) {
   (c > 0) ? putchar((char)c) : printf("\033[2J\033[1;1H");
@@ -132,29 +500,215 @@ void rxWriteConsole(CELL c) {
   }
 }
 
-CELL rxReadConsole(VM *vm) {
+/* Write cells from up to (but not including) to. Characters go through
+   a buffer, with anything rxWriteConsole() treats specially (backspace,
+   clearing the screen) flushing it first. Zero cells are skipped, as
+   by the kernel's putc. */
+void rxWriteConsoleRange(VM *vm, CELL from, CELL to) {
+  char buffer[CONSOLE_BUFFER];
+  int n = 0;
   CELL c;
-  if ((c = getc(vm->input[vm->isp])) == EOF && vm->input[vm->isp] != stdin) {
-    fclose(vm->input[vm->isp--]);
-    c = 0;
+
+  if (from < 0)
+    from = 0;
+  if (to > vm->image_size)
+    to = vm->image_size;
+  for (; from < to; from++) {
+    c = vm->image[from];
+    if (c > 0 && c != 8) {
+      buffer[n++] = (char)c;
+      if (n == CONSOLE_BUFFER) {
+        fwrite(buffer, 1, n, stdout);
+        n = 0;
+      }
+    } else if (c != 0) {
+      fwrite(buffer, 1, n, stdout);
+      n = 0;
+      rxWriteConsole(c);
+    }
   }
-  if (c == EOF && vm->input[vm->isp] == stdin)
+  fwrite(buffer, 1, n, stdout);
+}
+
+/* Write the zero terminated string at a */
+void rxWriteConsoleString(VM *vm, CELL a) {
+  CELL end = a;
+
+  if (a < 0 || a >= vm->image_size)
+    return;
+  while (end < vm->image_size && vm->image[end] != 0)
+    end++;
+  rxWriteConsoleRange(vm, a, end);
+}
+
+void rxRestoreIO(VM *vm);
+int rxFinishSave(VM *vm, int wait);
+
+/* Reading past the end of an included file drops it from the input
+   stack, returning 0. The end of stdin ends the run, once any save
+   running in the background has finished. */
+CELL rxReadInput(VM *vm) {
+  struct rxSource *in = &vm->input[vm->isp];
+  CELL c;
+
+  if (in->at < in->end)
+    return *in->at++;
+  if (in->file != NULL && (c = getc(in->file)) != EOF)
+    return c;
+  if (vm->isp == 0) {
+    rxRestoreIO(vm);
+    rxFinishSave(vm, 1);
     exit(0);
+  }
+  if (in->map != NULL)
+    munmap(in->map, in->size);
+  if (in->file != NULL)
+    fclose(in->file);
+  memset(in, 0, sizeof(struct rxSource));
+  vm->isp--;
+  return 0;
+}
+
+CELL rxReadConsole(VM *vm) {
+  if (vm->isp == 0)
+    fflush(stdout);
+  return rxReadInput(vm);
+}
+
+/* Token Input ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   rxAcceptToken() does what the kernel's accept does with getc, one
+   character per device call, for a whole token (or line) at a time:
+   the characters are remapped as by ws, echoed, and stored from the
+   address given up to the delimiter, which is replaced by a zero.
+   Backspace removes the last character stored. The flags are the
+   kernel's remapping (ACCEPT_REMAP), tabAsWhitespace (ACCEPT_TABS) and
+   eatLeading? (ACCEPT_EAT) variables.
+
+   Input comes from the same include stack as for single characters.
+   Output is flushed once per token read from stdin, rather than once
+   per character.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+#define ACCEPT_REMAP 1
+#define ACCEPT_TABS  2
+#define ACCEPT_EAT   4
+
+CELL rxReadKey(VM *vm, CELL flags) {
+  CELL c;
+
+  while ((c = rxReadInput(vm)) == 0)
+    if (vm->isp == 0)
+      fflush(stdout);
+  if (c == 127)
+    c = 8;
+  if (c == 13)
+    c = 10;
+  if (flags & ACCEPT_REMAP) {
+    if (c == 10)
+      c = 32;
+    if (c == 9 && (flags & ACCEPT_TABS))
+      c = 32;
+  }
   return c;
 }
 
+int rxWritable(VM *vm, CELL a, CELL n);
+
+void rxAcceptToken(VM *vm) {
+  CELL flags, delimiter, start, a, hi, c;
+
+  flags = TOS; DROP;
+  delimiter = TOS; DROP;
+  start = a = hi = TOS; DROP;
+
+  if (vm->isp == 0)
+    fflush(stdout);
+  if (flags & ACCEPT_EAT) {
+    while ((c = rxReadKey(vm, flags)) == 8 || c == delimiter)
+      if (c != 8)
+        rxWriteConsole(c);
+    rxWriteConsole(c);
+    if (rxWritable(vm, a, 1))
+      vm->image[a] = c;
+    hi = ++a;
+  }
+  while (1) {
+    c = rxReadKey(vm, flags);
+    if (c == 8) {
+      if (--a + 1 < start)
+        a = start;
+      else
+        rxWriteConsole(8);
+      continue;
+    }
+    rxWriteConsole(c);
+    if (c == delimiter)
+      break;
+    if (rxWritable(vm, a, 1))
+      vm->image[a] = c;
+    if (++a > hi)
+      hi = a;
+  }
+  if (rxWritable(vm, a, 1))
+    vm->image[a] = 0;
+  if (start < 0)
+    start = 0;
+  if (hi >= vm->image_size)
+    hi = vm->image_size - 1;
+  if (start <= hi)
+    rxImageWritten(vm, start, hi - start + 1);
+}
+
+/* Regular files are mapped and read directly from memory. Anything
+   that can't be mapped is read through stdio as before. */
 void rxIncludeFile(VM *vm, char *s) {
-  FILE *file;
-  if ((file = fopen(s, "r")))
-    vm->input[++vm->isp] = file;
+  struct rxSource *in;
+  struct stat st;
+  void *map;
+  int fd;
+
+  if (vm->isp + 1 >= MAX_OPEN_FILES || (fd = open(s, O_RDONLY)) < 0)
+    return;
+  in = &vm->input[vm->isp + 1];
+  memset(in, 0, sizeof(struct rxSource));
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    if (st.st_size == 0) {
+      close(fd);
+      vm->isp++;
+      return;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      close(fd);
+      in->map = in->at = map;
+      in->size = st.st_size;
+      in->end = in->at + in->size;
+      vm->isp++;
+      return;
+    }
+  }
+  if ((in->file = fdopen(fd, "r")) == NULL) {
+    close(fd);
+    return;
+  }
+  vm->isp++;
 }
 
 void rxPrepareInput(VM *vm) {
   vm->isp = 0;
-  vm->input[vm->isp] = stdin;
+  memset(&vm->input[0], 0, sizeof(struct rxSource));
+  vm->input[0].file = stdin;
 }
 
+/* Output to a terminal is left to stdio as it always was. Anything else
+   is fully buffered through a large buffer, flushed when reading from
+   stdin, when saving the image, on exit, and when asked to by writing 4
+   to port 2. */
 void rxPrepareOutput(VM *vm) {
+  static char buffer[OUTPUT_BUFFER];
+
+  if (!isatty(1))
+    setvbuf(stdout, buffer, _IOFBF, OUTPUT_BUFFER);
   tcgetattr(0, &vm->old_termios);
   vm->new_termios = vm->old_termios;
   vm->new_termios.c_iflag &= ~(BRKINT+ISTRIP+IXON+IXOFF);
@@ -255,12 +809,1003 @@ CELL rxDeleteFile(VM *vm) {
   return (unlink(vm->request) == 0) ? -1 : 0;
 }
 
+/* Block File I/O ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   These move a whole block between a file and the image in one device
+   call, in place of one call per byte with -2 and -3:
+
+     -9   a n h-n   read up to n bytes into the cells from a
+     -10  a n h-n   write the n cells from a as bytes
+     -11  a n h-n   read a line (up to a byte from 10 to 13) into the
+                    cells from a, stopping after n-1 characters, and
+                    zero terminate it
+
+   Each returns the number of bytes moved. The bytes go through a buffer,
+   widened to cells or narrowed from them in runs of a fixed length,
+   which compilers turn into vector instructions at -O2. Addresses
+   outside the image are clipped off.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+#define BLOCK_RUN 16
+
+void rxWiden(CELL *restrict to, unsigned char *restrict from, size_t n) {
+  size_t i, j;
+
+  for (i = 0; i + BLOCK_RUN <= n; i += BLOCK_RUN)
+    for (j = 0; j < BLOCK_RUN; j++)
+      to[i + j] = from[i + j];
+  for (; i < n; i++)
+    to[i] = from[i];
+}
+
+void rxNarrow(unsigned char *restrict to, CELL *restrict from, size_t n) {
+  size_t i, j;
+
+  for (i = 0; i + BLOCK_RUN <= n; i += BLOCK_RUN)
+    for (j = 0; j < BLOCK_RUN; j++)
+      to[i + j] = (unsigned char)from[i + j];
+  for (; i < n; i++)
+    to[i] = (unsigned char)from[i];
+}
+
+FILE *rxBlockArguments(VM *vm, CELL *a, CELL *n) {
+  CELL slot;
+
+  slot = TOS; DROP;
+  *n = TOS; DROP;
+  *a = TOS; DROP;
+  if (*a < 0 || *a >= vm->image_size || *n < 0)
+    *n = 0;
+  else if (*n > vm->image_size - *a)
+    *n = vm->image_size - *a;
+  if (slot <= 0 || slot >= MAX_OPEN_FILES)
+    return NULL;
+  return vm->files[slot];
+}
+
+CELL rxReadBlock(VM *vm) {
+  unsigned char buffer[FILE_BUFFER];
+  CELL a, n, *to;
+  size_t want, got, total = 0;
+  FILE *fp;
+
+  if ((fp = rxBlockArguments(vm, &a, &n)) == NULL || n == 0 ||
+      !rxWritable(vm, a, n))
+    return 0;
+  to = vm->image + a;
+  while (total < (size_t)n) {
+    want = (size_t)n - total < FILE_BUFFER ? (size_t)n - total : FILE_BUFFER;
+    if ((got = fread(buffer, 1, want, fp)) == 0)
+      break;
+    rxWiden(to + total, buffer, got);
+    total += got;
+  }
+  if (total > 0)
+    rxImageWritten(vm, a, total);
+  return total;
+}
+
+CELL rxWriteBlock(VM *vm) {
+  unsigned char buffer[FILE_BUFFER];
+  CELL a, n, *from;
+  size_t chunk, total = 0;
+  FILE *fp;
+
+  if ((fp = rxBlockArguments(vm, &a, &n)) == NULL)
+    return 0;
+  from = vm->image + a;
+  while (total < (size_t)n) {
+    chunk = (size_t)n - total < FILE_BUFFER ? (size_t)n - total : FILE_BUFFER;
+    rxNarrow(buffer, from + total, chunk);
+    if (fwrite(buffer, 1, chunk, fp) != chunk)
+      break;
+    total += chunk;
+  }
+  return total;
+}
+
+CELL rxReadLine(VM *vm) {
+  CELL a, n, i = 0;
+  int c;
+  FILE *fp;
+
+  if ((fp = rxBlockArguments(vm, &a, &n)) == NULL || n == 0 ||
+      !rxWritable(vm, a, n))
+    return 0;
+  flockfile(fp);
+  while (i < n - 1 && (c = getc_unlocked(fp)) != EOF && (c < 10 || c > 13))
+    vm->image[a + i++] = c;
+  funlockfile(fp);
+  vm->image[a + i] = 0;
+  rxImageWritten(vm, a, i + 1);
+  return i;
+}
+
+/* Image Size ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   The VM reserves room for MAX_IMAGE_SIZE cells, but only the first
+   vm->image_size are in use: IMAGE_SIZE, or the size of the image file
+   if that is larger. The image grows with --ram, through port 5:
+
+     -1   -n   the number of cells in use
+     -24  n-m  grow to at least n cells, returning the new size
+     -25  -n   the most cells the image can grow to
+
+   or by storing past the end, which grows it to the end of the page
+   stored into. Fetches past the end return 0. Stores and fetches
+   outside the reserved room are dropped.
+
+   The engines send stores at or past vm->store_limit to
+   rxStoreOutside(). This is the image size, or the start of the lowest
+   read-only mapped file (see Mapped Files below) if that comes first,
+   so stores into those are dropped without a check on the fast path.
+
+   As for the rest of the VM, pages only take memory once touched, so a
+   large image costs nothing until it is used. Scans over the image
+   (saving, decoding, statistics) stop at vm->image_size. The tables
+   indexed by address (vm->shadow[] and the like) are allocated apart,
+   for vm->table_size cells, and grow along with the image. They have
+   TABLE_SLACK entries past its end, for the engines to step onto before
+   finding they have left the image.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+#define TABLE_SLACK 4
+
+/* The offset in bytes of the first page boundary at or after cells. The
+   last page of the image is shared with the fields after it, so is not
+   counted. */
+size_t rxImagePages(long cells) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t end = (size_t)MAX_IMAGE_SIZE * sizeof(CELL) / page * page;
+  size_t at = ((size_t)cells * sizeof(CELL) + page - 1) / page * page;
+  return (at < end) ? at : end;
+}
+
+CELL rxPageCells() {
+  return sysconf(_SC_PAGESIZE) / sizeof(CELL);
+}
+
+/* Moves *table from from to to entries of width bytes. Tables are
+   mapped like the VM, so the new entries are zero and take no memory
+   until used. */
+int rxGrowTable(void **table, size_t width, long from, long to) {
+  void *t;
+
+#ifdef MREMAP_MAYMOVE
+  if (*table != NULL) {
+    t = mremap(*table, from * width, to * width, MREMAP_MAYMOVE);
+    if (t == MAP_FAILED)
+      return 0;
+    *table = t;
+    return 1;
+  }
+#endif
+  t = mmap(NULL, to * width, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (t == MAP_FAILED)
+    return 0;
+  if (*table != NULL) {
+    memcpy(t, *table, from * width);
+    munmap(*table, from * width);
+  }
+  *table = t;
+  return 1;
+}
+
+void rxFreeTable(void *table, size_t width, long size) {
+  if (table != NULL)
+    munmap(table, size * width);
+}
+
+/* Makes room in the tables for cells, doubling them each time */
+int rxGrowTables(VM *vm, long cells) {
+  long from = vm->table_size, to = from * 2;
+
+  if (cells + TABLE_SLACK <= from)
+    return 1;
+  if (to < cells + TABLE_SLACK)
+    to = cells + TABLE_SLACK;
+  if (to > MAX_IMAGE_SIZE + TABLE_SLACK)
+    to = MAX_IMAGE_SIZE + TABLE_SLACK;
+#if RXSTATS > 1
+  if (!rxGrowTable((void **)&vm->calls, sizeof(uint64_t), from, to))
+    return 0;
+#endif
+#ifdef RXTHREADED
+  if (!rxGrowTable((void **)&vm->shadow, sizeof(int32_t), from, to) ||
+      !rxGrowTable((void **)&vm->target, sizeof(CELL), from, to) ||
+      !rxGrowTable((void **)&vm->skipped, 1, from, to) ||
+      !rxGrowTable((void **)&vm->examined, 1, from, to))
+    return 0;
+#endif
+#ifdef RXJIT
+  if (!rxGrowTable((void **)&vm->jit_entry, sizeof(void *), from, to) ||
+      !rxGrowTable((void **)&vm->jit_covered, 1, from, to) ||
+      !rxGrowTable((void **)&vm->jit_hits, sizeof(int), from, to))
+    return 0;
+#endif
+#ifdef RXAOT
+  if (!rxGrowTable((void **)&vm->aot_entry, 1, from, to) ||
+      !rxGrowTable((void **)&vm->aot_covered, 1, from, to))
+    return 0;
+#endif
+  vm->table_size = to;
+  return 1;
+}
+
+int rxReadOnly(VM *vm, CELL a, CELL n);
+void rxSetStoreLimit(VM *vm);
+
+CELL rxGrowImage(VM *vm, long cells) {
+  if (cells > MAX_IMAGE_SIZE)
+    cells = MAX_IMAGE_SIZE;
+  if (cells <= vm->image_size || !rxGrowTables(vm, cells))
+    return vm->image_size;
+  vm->image_size = cells;
+  rxSetStoreLimit(vm);
+#ifdef RXTHREADED
+  /* Calls and jumps past the old end were decoded as halting */
+  if (vm->past_end) {
+    rxFlushDecoded(vm);
+    vm->past_end = 0;
+  }
+#endif
+  return vm->image_size;
+}
+
+/* Stores outside the image, or at or past vm->store_limit, land here */
+void rxStoreOutside(VM *vm, CELL a, CELL value) {
+  CELL page = rxPageCells();
+
+  if (a >= 0 && a < vm->image_size) {
+    if (rxReadOnly(vm, a, 1))
+      return;
+    vm->image[a] = value;
+    rxImageWritten(vm, a, 1);
+    return;
+  }
+  if (a < 0 || a >= MAX_IMAGE_SIZE ||
+      rxGrowImage(vm, ((long)a / page + 1) * page) <= a)
+    return;
+  vm->image[a] = value;
+  rxImageWritten(vm, a, 1);
+}
+
+/* Huge Pages ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   Fetches and stores scattered over a large image miss the TLB on most
+   accesses when it is in normal pages. With --huge, the image is backed
+   by huge pages instead, where the system has them:
+
+   - The usable image is mapped again with MAP_HUGETLB, if enough huge
+     pages are reserved (in /proc/sys/vm/nr_hugepages).
+   - The rest of the image, or all of it if that fails, is marked with
+     madvise for the kernel to use transparent huge pages, which it does
+     when it can.
+
+   This is done before loading, and the image file is then read in
+   rather than mapped. Huge pages can't be partly replaced, so files
+   mapped over the part of the image in MAP_HUGETLB pages (with port 4's
+   -12) are copied in instead.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+void rxHugeImage(VM *vm) {
+  size_t end = rxImagePages(MAX_IMAGE_SIZE);
+  size_t used = rxImagePages(vm->image_size);
+  size_t length = (used + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+
+  vm->huge = 1;
+#ifdef MAP_HUGETLB
+  if (length > end / HUGE_PAGE * HUGE_PAGE)
+    length = end / HUGE_PAGE * HUGE_PAGE;
+  if (length > 0 &&
+      mmap(vm->image, length, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+           MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0) != MAP_FAILED)
+    vm->hugetlb = length;
+  else if (length > 0) {
+    /* A failed MAP_FIXED may have removed the old pages */
+    mmap(vm->image, length, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+         MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+  }
+#endif
+#ifdef MADV_HUGEPAGE
+  if (end > vm->hugetlb)
+    madvise((char *)vm->image + vm->hugetlb, end - vm->hugetlb,
+            MADV_HUGEPAGE);
+#endif
+}
+
+/* Mapped Files ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   The VM is allocated with mmap, with the image page aligned, so a file
+   of cells (in the VM's cell size and byte order) can be mapped over
+   part of the image instead of being read in:
+
+     -12  a $ m-n   map the file named $ over the cells from a, with m
+                    0 for read-only or 3 for copy-on-write
+     -13  a-f       remove the mapping made at a
+
+   a must be a multiple of the page size in cells, given by query -22.
+   -12 returns the number of cells mapped (rounded up to a whole cell),
+   or 0 if the file can't be mapped there. Cells past the end of the
+   file, up to the end of its last page, read as zero.
+
+   Stores into a copy-on-write mapping change only the image, never the
+   file. Stores into a read-only mapping are dropped, like those outside
+   the image: the engines leave them to rxStoreOutside() (see Image Size
+   above), and devices reading into the image check with rxWritable().
+   The pages are mapped without write access, so anything missing the
+   check faults rather than changing the cells. Unmapping releases the
+   memory, leaving the cells zeroed. The file is kept open with a shared
+   lock while mapped, so an image being saved over it is written to a
+   new file instead (see Images below).
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+#define MAPPED_READ   0
+#define MAPPED_MODIFY 3
+
+/* Whether any of the n cells from a are in a read-only mapping */
+int rxReadOnly(VM *vm, CELL a, CELL n) {
+  CELL i;
+
+  if (a + n <= vm->store_limit)
+    return 0;
+  for (i = 0; i < MAX_MAPPINGS; i++)
+    if (vm->maps[i].size != 0 && vm->maps[i].mode == MAPPED_READ &&
+        a < vm->maps[i].start + (CELL)(vm->maps[i].size / sizeof(CELL)) &&
+        vm->maps[i].start < a + n)
+      return 1;
+  return 0;
+}
+
+/* Whether a device may write the n cells from a */
+int rxWritable(VM *vm, CELL a, CELL n) {
+  return a >= 0 && n >= 0 && n <= vm->image_size - a &&
+         !rxReadOnly(vm, a, n);
+}
+
+void rxSetStoreLimit(VM *vm) {
+  CELL i;
+
+  vm->store_limit = vm->image_size;
+  for (i = 0; i < MAX_MAPPINGS; i++)
+    if (vm->maps[i].size != 0 && vm->maps[i].mode == MAPPED_READ &&
+        vm->maps[i].start < vm->store_limit)
+      vm->store_limit = vm->maps[i].start;
+}
+
+/* The pages holding the VM, from start for size bytes */
+void rxVMPages(VM *vm, char **start, size_t *size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t from = (uintptr_t)vm / page * page;
+  uintptr_t to = ((uintptr_t)vm + sizeof(VM) + page - 1) / page * page;
+
+  *start = (char *)from;
+  *size = to - from;
+}
+
+/* Enough is mapped to place the image on a huge page boundary, and
+   the unused pages around the VM are then given back. */
+VM *rxAllocVM() {
+  size_t size;
+  char *at = mmap(NULL, sizeof(VM) + 2 * HUGE_PAGE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  char *start, *end;
+  VM *vm;
+
+  if (at == MAP_FAILED) {
+    printf("Unable to allocate memory for the VM!\n");
+    exit(1);
+  }
+  end = at + sizeof(VM) + 2 * HUGE_PAGE;
+  vm = (VM *)(at + HUGE_PAGE -
+              ((uintptr_t)at + offsetof(VM, image)) % HUGE_PAGE);
+  rxVMPages(vm, &start, &size);
+  if (start > at)
+    munmap(at, start - at);
+  if (start + size < end)
+    munmap(start + size, end - start - size);
+  if (!rxGrowTables(vm, IMAGE_SIZE)) {
+    printf("Unable to allocate memory for the VM!\n");
+    exit(1);
+  }
+  vm->image_size = vm->store_limit = IMAGE_SIZE;
+  vm->image_fd = -1;
+  return vm;
+}
+
+void rxFreeVM(VM *vm) {
+  char *start;
+  size_t size;
+
+  free(vm->ports);
+  free(vm->devices);
+  free(vm->dirty);
+  free(vm->attached);
+#if RXSTATS > 1
+  rxFreeTable(vm->calls, sizeof(uint64_t), vm->table_size);
+#endif
+#ifdef RXTHREADED
+  rxFreeTable(vm->shadow, sizeof(int32_t), vm->table_size);
+  rxFreeTable(vm->target, sizeof(CELL), vm->table_size);
+  rxFreeTable(vm->skipped, 1, vm->table_size);
+  rxFreeTable(vm->examined, 1, vm->table_size);
+#endif
+#ifdef RXJIT
+  rxFreeTable(vm->jit_entry, sizeof(void *), vm->table_size);
+  rxFreeTable(vm->jit_covered, 1, vm->table_size);
+  rxFreeTable(vm->jit_hits, sizeof(int), vm->table_size);
+#endif
+#ifdef RXAOT
+  rxFreeTable(vm->aot_entry, 1, vm->table_size);
+  rxFreeTable(vm->aot_covered, 1, vm->table_size);
+#endif
+  if (vm->image_fd >= 0)
+    close(vm->image_fd);
+  rxVMPages(vm, &start, &size);
+  munmap(start, size);
+}
+
+/* Copies a file of bytes into memory to, zero filling it up to size */
+void *rxCopyFile(int fd, void *to, size_t bytes, size_t size) {
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < bytes &&
+         (n = pread(fd, (char *)to + done, bytes - done, done)) > 0)
+    done += n;
+  if (done < bytes)
+    return MAP_FAILED;
+  memset((char *)to + bytes, 0, size - bytes);
+  return to;
+}
+
+CELL rxMapFile(VM *vm) {
+  CELL a, name, mode, slot, cells, i;
+  size_t page, size;
+  struct stat st;
+  int fd;
+  void *at;
+
+  mode = TOS; DROP;
+  name = TOS; DROP;
+  a    = TOS; DROP;
+  rxGetString(vm, name);
+  for (slot = 0; slot < MAX_MAPPINGS && vm->maps[slot].size != 0; slot++)
+    ;
+  page = sysconf(_SC_PAGESIZE);
+  if (slot == MAX_MAPPINGS || a < 0 || a >= vm->image_size ||
+      (uintptr_t)(vm->image + a) % page != 0)
+    return 0;
+  if (mode != MAPPED_READ && mode != MAPPED_MODIFY)
+    return 0;
+  if ((fd = open(vm->request, O_RDONLY)) < 0)
+    return 0;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  size = (st.st_size + page - 1) / page * page;
+  cells = size / sizeof(CELL);
+  for (i = 0; i < MAX_MAPPINGS; i++)
+    if (vm->maps[i].size != 0 && a < vm->maps[i].start +
+        (CELL)(vm->maps[i].size / sizeof(CELL)) && vm->maps[i].start < a + cells)
+      break;
+  if (i < MAX_MAPPINGS || cells > vm->image_size - a) {
+    close(fd);
+    return 0;
+  }
+  if ((size_t)a * sizeof(CELL) < vm->hugetlb)
+    at = rxCopyFile(fd, vm->image + a, st.st_size, size);
+  else
+    at = mmap(vm->image + a, size, (mode == MAPPED_READ) ? PROT_READ :
+              PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0);
+  if (at == MAP_FAILED) {
+    close(fd);
+    return 0;
+  }
+  flock(fd, LOCK_SH);
+  vm->maps[slot].start = a;
+  vm->maps[slot].mode = mode;
+  vm->maps[slot].size = size;
+  vm->maps[slot].fd = fd;
+  rxSetStoreLimit(vm);
+  rxImageWritten(vm, a, cells);
+  return (st.st_size + sizeof(CELL) - 1) / sizeof(CELL);
+}
+
+CELL rxUnmapFile(VM *vm) {
+  CELL a, slot;
+
+  a = TOS; DROP;
+  for (slot = 0; slot < MAX_MAPPINGS; slot++)
+    if (vm->maps[slot].size != 0 && vm->maps[slot].start == a)
+      break;
+  if (slot == MAX_MAPPINGS)
+    return 0;
+  if ((size_t)a * sizeof(CELL) < vm->hugetlb)
+    memset(vm->image + a, 0, vm->maps[slot].size);
+  else if (mmap(vm->image + a, vm->maps[slot].size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+    return 0;
+  rxImageWritten(vm, a, vm->maps[slot].size / sizeof(CELL));
+  close(vm->maps[slot].fd);
+  vm->maps[slot].size = 0;
+  rxSetStoreLimit(vm);
+  return -1;
+}
+
+/* Asynchronous File I/O ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   Port 9 runs file requests on a pool of worker threads, so the image
+   keeps running while they wait on the disk. The caller tags each
+   request with an id, which is handed back when it completes:
+
+     1  a n h i-f   read up to n bytes from handle h into the cells from a
+     2  a n h i-f   write the n cells from a to handle h as bytes
+     3  $ m i-f     open the named file with mode m, as port 4's -1
+     4  -i          the id of a completed request, or 0 if none is ready
+     5  -i          as 4, but waits while any requests are running
+     6  -n          the result of the request last returned by 4 or 5:
+                    the bytes read or written, or the new handle
+
+   Submitting returns -1, or 0 if the request was refused. Cells to write
+   are copied when the request is made. Bytes read are stored into the
+   image only when 4 or 5 returns the request, so the workers never touch
+   the image. Requests on one handle may run in any order, and a handle
+   must not be closed while a request on it is running.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+#ifndef RXNOASYNC
+#define ASYNC_WORKERS   4
+#define ASYNC_REQUESTS 64
+
+enum async_ops {ASYNC_READ = 1, ASYNC_WRITE, ASYNC_OPEN, ASYNC_POLL,
+                ASYNC_WAIT, ASYNC_RESULT};
+
+struct rxRequest {
+  int op, mode;
+  CELL id, a, n, result;
+  FILE *file;
+  unsigned char *bytes;
+  char name[MAX_REQUEST_LENGTH + 1];
+  struct rxRequest *next;
+};
+
+struct rxAsync {
+  pthread_mutex_t lock;
+  pthread_cond_t queued, finished;
+  struct rxRequest *waiting, *done;
+  int pending;
+  CELL result;
+};
+
+void rxAppendRequest(struct rxRequest **list, struct rxRequest *r) {
+  while (*list != NULL)
+    list = &(*list)->next;
+  r->next = NULL;
+  *list = r;
+}
+
+void *rxAsyncWorker(void *arg) {
+  static const char *modes[] = { "r", "w", "a", "r+" };
+  struct rxAsync *io = arg;
+  struct rxRequest *r;
+
+  pthread_mutex_lock(&io->lock);
+  while (1) {
+    while (io->waiting == NULL)
+      pthread_cond_wait(&io->queued, &io->lock);
+    r = io->waiting;
+    io->waiting = r->next;
+    pthread_mutex_unlock(&io->lock);
+    switch (r->op) {
+      case ASYNC_READ:  r->result = fread(r->bytes, 1, r->n, r->file);
+                        break;
+      case ASYNC_WRITE: r->result = fwrite(r->bytes, 1, r->n, r->file);
+                        break;
+      case ASYNC_OPEN:  r->file = fopen(r->name, modes[r->mode]);
+                        break;
+    }
+    pthread_mutex_lock(&io->lock);
+    rxAppendRequest(&io->done, r);
+    pthread_cond_signal(&io->finished);
+  }
+  return NULL;
+}
+
+struct rxAsync *rxStartAsync(VM *vm) {
+  struct rxAsync *io;
+  pthread_t worker;
+  int i;
+
+  if (vm->async != NULL)
+    return vm->async;
+  if ((io = calloc(1, sizeof(struct rxAsync))) == NULL)
+    return NULL;
+  pthread_mutex_init(&io->lock, NULL);
+  pthread_cond_init(&io->queued, NULL);
+  pthread_cond_init(&io->finished, NULL);
+  for (i = 0; i < ASYNC_WORKERS; i++)
+    if (pthread_create(&worker, NULL, rxAsyncWorker, io) == 0)
+      pthread_detach(worker);
+    else if (i == 0)
+      return NULL;
+  return vm->async = io;
+}
+
+CELL rxAsyncSubmit(VM *vm, int op) {
+  struct rxAsync *io;
+  struct rxRequest *r;
+
+  if ((r = calloc(1, sizeof(struct rxRequest))) == NULL)
+    return 0;
+  r->op = op;
+  r->id = TOS; DROP;
+  if (op == ASYNC_OPEN) {
+    r->mode = TOS; DROP;
+    rxGetString(vm, TOS); DROP;
+    strcpy(r->name, vm->request);
+  }
+  else if ((r->file = rxBlockArguments(vm, &r->a, &r->n)) != NULL &&
+           (r->bytes = malloc(r->n + 1)) != NULL && op == ASYNC_WRITE)
+    rxNarrow(r->bytes, vm->image + r->a, r->n);
+  if ((io = rxStartAsync(vm)) == NULL || r->id == 0 ||
+      io->pending == ASYNC_REQUESTS || (op == ASYNC_OPEN && (r->mode < 0 ||
+      r->mode > 3)) || (op != ASYNC_OPEN && r->bytes == NULL) ||
+      (op == ASYNC_READ && !rxWritable(vm, r->a, r->n))) {
+    free(r->bytes);
+    free(r);
+    return 0;
+  }
+  pthread_mutex_lock(&io->lock);
+  io->pending++;
+  rxAppendRequest(&io->waiting, r);
+  pthread_cond_signal(&io->queued);
+  pthread_mutex_unlock(&io->lock);
+  return -1;
+}
+
+CELL rxAsyncComplete(VM *vm, int block) {
+  struct rxAsync *io = vm->async;
+  struct rxRequest *r;
+  CELL id, slot;
+
+  if (io == NULL)
+    return 0;
+  pthread_mutex_lock(&io->lock);
+  while (block && io->done == NULL && io->pending > 0)
+    pthread_cond_wait(&io->finished, &io->lock);
+  if ((r = io->done) != NULL) {
+    io->done = r->next;
+    io->pending--;
+  }
+  pthread_mutex_unlock(&io->lock);
+  if (r == NULL)
+    return 0;
+  /* The cells may have been mapped read-only since the request */
+  if (r->op == ASYNC_READ && r->result > 0 &&
+      rxWritable(vm, r->a, r->result)) {
+    rxWiden(vm->image + r->a, r->bytes, r->result);
+    rxImageWritten(vm, r->a, r->result);
+  }
+  if (r->op == ASYNC_OPEN) {
+    r->result = 0;
+    if (r->file != NULL && (slot = rxGetFileHandle(vm)) > 0) {
+      vm->files[slot] = r->file;
+      r->result = slot;
+    }
+    else if (r->file != NULL)
+      fclose(r->file);
+  }
+  io->result = r->result;
+  id = r->id;
+  free(r->bytes);
+  free(r);
+  return id;
+}
+
+CELL rxAsyncDevice(VM *vm, CELL op) {
+  switch (op) {
+    case ASYNC_READ:
+    case ASYNC_WRITE:
+    case ASYNC_OPEN:   return rxAsyncSubmit(vm, op);
+    case ASYNC_POLL:   return rxAsyncComplete(vm, 0);
+    case ASYNC_WAIT:   return rxAsyncComplete(vm, 1);
+    case ASYNC_RESULT: return vm->async ? vm->async->result : 0;
+  }
+  return 0;
+}
+#endif
+
+/* Images ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   The image file is mapped copy-on-write over vm->image, so its pages
+   are read in as they are used and processes running the same image
+   share them in the page cache. The rest of the image is the anonymous
+   memory of rxAllocVM(), zero filled as it is touched. The image grows
+   to hold a larger file. Cells past the last whole page that fits in
+   the image are read as usual.
+
+   Saving writes only the blocks marked in vm->changed[], and those
+   past the old end of the file, back into the file the image was
+   loaded from or last saved to. They are first written to a journal
+   (the image's name with .journal added), which is synced before the
+   image file is touched and removed once it has been. If a save is cut
+   short, the next load replays the journal to finish it.
+
+   A running VM holds a shared lock on the image it loaded, and on the
+   files it has mapped. The file is only written in place if this VM
+   can take an exclusive lock on it and it is the same file (inode,
+   size and time) it last loaded or saved. Otherwise the whole image is
+   written to a new file, synced and renamed over the old one, leaving
+   the file used by any other process intact. Other programs changing
+   an image should do the same, rather than rewrite it in place.
+
+   Pages of the mapping not yet written to still read from the file, so
+   before writing it in place the VM moves the image into anonymous
+   memory (rxDetachImage). A write, and above all a truncation, would
+   otherwise change or remove cells under it, and touching a page past
+   the new end of the file raises SIGBUS. If this can't be done, the
+   whole image is written to a new file instead.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+#define JOURNAL_MAGIC 0x6c616e72756f4a78ULL
+#define FNV_BASIS     14695981039346656037ULL
+#define FNV_PRIME     1099511628211ULL
+
+/* Ends a journal of count entries, each an offset and length in bytes
+   followed by the bytes to write there. The image file (dev, ino) is
+   then cut to size bytes. sum is the FNV-1a hash of the entries. */
+struct rxJournalEnd {
+  uint64_t magic, dev, ino, size, count, sum;
+};
+
+uint64_t rxHash(uint64_t sum, const void *data, size_t n) {
+  const unsigned char *p = data;
+
+  while (n-- > 0)
+    sum = (sum ^ *p++) * FNV_PRIME;
+  return sum;
+}
+
+int rxWriteAt(int fd, const void *data, size_t n, off_t at) {
+  ssize_t w;
+
+  while (n > 0) {
+    if ((w = pwrite(fd, data, n, at)) < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return 0;
+    data = (const char *)data + w;
+    n -= w;
+    at += w;
+  }
+  return 1;
+}
+
+/* Syncs the directory holding file, so that creating or renaming it
+   is on disk as well */
+void rxSyncDirectory(char *file) {
+  char dir[MAX_FILE_NAME + 2];
+  char *slash;
+  int fd;
+
+  snprintf(dir, sizeof(dir), "%s", file);
+  if ((slash = strrchr(dir, '/')) == NULL)
+    strcpy(dir, ".");
+  else
+    slash[slash == dir] = 0;
+  if ((fd = open(dir, O_RDONLY)) >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+/* Records fd as holding the first cells cells of the image */
+void rxSavedAs(VM *vm, int fd, long cells) {
+  struct stat st;
+
+  vm->saved.known = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+  if (vm->saved.known) {
+    vm->saved.dev = st.st_dev;
+    vm->saved.ino = st.st_ino;
+    vm->saved.size = st.st_size;
+    vm->saved.mtime = st.st_mtim;
+  }
+  vm->saved.cells = cells;
+  memset(vm->changed, 0, sizeof(vm->changed));
+}
+
+/* Returns the start of the next run of cells from a (the start of a
+   block, or cells) that has to be saved, setting *end, or cells if
+   there are none */
+long rxNextRun(VM *vm, long a, long cells, long *end) {
+  long block = SAVE_CELLS;
+
+  while (a < cells && !vm->changed[a / block] && a + block <= vm->saved.cells)
+    a += block;
+  for (*end = a; *end < cells && (vm->changed[*end / block] ||
+                                  *end + block > vm->saved.cells); )
+    *end += block;
+  if (*end > cells)
+    *end = cells;
+  return (a < cells) ? a : cells;
+}
+
+int rxWriteJournal(VM *vm, char *journal, struct stat *st, long cells) {
+  struct rxJournalEnd end;
+  uint64_t entry[2];
+  long a, to;
+  off_t at = 0;
+  int fd, ok = 1;
+
+  if ((fd = open(journal, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+    return 0;
+  end.magic = JOURNAL_MAGIC;
+  end.dev = st->st_dev;
+  end.ino = st->st_ino;
+  end.size = cells * sizeof(CELL);
+  end.count = 0;
+  end.sum = FNV_BASIS;
+  for (a = rxNextRun(vm, 0, cells, &to); ok && a < cells;
+       a = rxNextRun(vm, to, cells, &to)) {
+    entry[0] = a * sizeof(CELL);
+    entry[1] = (to - a) * sizeof(CELL);
+    ok = rxWriteAt(fd, entry, sizeof(entry), at) &&
+         rxWriteAt(fd, vm->image + a, entry[1], at + sizeof(entry));
+    end.sum = rxHash(rxHash(end.sum, entry, sizeof(entry)),
+                     vm->image + a, entry[1]);
+    end.count++;
+    at += sizeof(entry) + entry[1];
+  }
+  ok = ok && rxWriteAt(fd, &end, sizeof(end), at) && fsync(fd) == 0;
+  if (close(fd) != 0 || !ok) {
+    unlink(journal);
+    return 0;
+  }
+  rxSyncDirectory(journal);
+  return 1;
+}
+
+/* Finishes a save cut short after its journal was written, or removes
+   a journal that is incomplete or for another file. The journal is
+   kept if the image is in use, or can't be written. */
+void rxReplayJournal(char *image) {
+  char journal[MAX_FILE_NAME + 9];
+  struct rxJournalEnd end;
+  struct stat st;
+  uint64_t entry[2], n;
+  unsigned char *data = NULL;
+  size_t at = 0, length = 0;
+  int fd, ok = 0, keep = 0;
+
+  snprintf(journal, sizeof(journal), "%s.journal", image);
+  if ((fd = open(journal, O_RDONLY)) < 0)
+    return;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(end) &&
+      (data = malloc(st.st_size)) != NULL &&
+      rxCopyFile(fd, data, st.st_size, st.st_size) != MAP_FAILED) {
+    length = st.st_size - sizeof(end);
+    memcpy(&end, data + length, sizeof(end));
+    ok = end.magic == JOURNAL_MAGIC && rxHash(FNV_BASIS, data, length) == end.sum;
+  }
+  close(fd);
+  if (ok && (fd = open(image, O_RDWR)) >= 0) {
+    if (fstat(fd, &st) == 0 && st.st_dev == end.dev && st.st_ino == end.ino) {
+      keep = flock(fd, LOCK_EX | LOCK_NB) != 0;
+      for (n = 0; !keep && n < end.count; n++) {
+        if ((keep = length - at < sizeof(entry)))
+          break;
+        memcpy(entry, data + at, sizeof(entry));
+        at += sizeof(entry);
+        keep = entry[1] > length - at ||
+               !rxWriteAt(fd, data + at, entry[1], entry[0]);
+        at += entry[1];
+      }
+      keep = keep || ftruncate(fd, end.size) != 0 || fsync(fd) != 0;
+    }
+    close(fd);
+  }
+  free(data);
+  if (!keep)
+    unlink(journal);
+}
+
+/* Replaces the mapping of the image file with anonymous memory holding
+   the same cells. Returns 0 if the image is still mapped. */
+int rxDetachImage(VM *vm) {
+#ifdef MREMAP_FIXED
+  size_t length = vm->image_mapped;
+  void *copy;
+
+  if (length == 0)
+    return 1;
+  copy = mmap(NULL, length, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (copy == MAP_FAILED)
+    return 0;
+  memcpy(copy, vm->image, length);
+  if (mremap(copy, length, length, MREMAP_MAYMOVE | MREMAP_FIXED,
+             vm->image) == MAP_FAILED) {
+    munmap(copy, length);
+    return 0;
+  }
+  vm->image_mapped = 0;
+#endif
+  return vm->image_mapped == 0;
+}
+
+/* Writes the changed blocks into the image file in place, returning 0
+   if the whole image has to be saved instead */
+int rxSaveChanges(VM *vm, char *image, long cells) {
+  char journal[MAX_FILE_NAME + 9];
+  struct stat st, loaded;
+  long a, to;
+  int fd, lock, done = 0;
+
+  if (!vm->saved.known || (fd = open(image, O_RDWR)) < 0)
+    return 0;
+  if (fstat(fd, &st) != 0 || st.st_dev != vm->saved.dev ||
+      st.st_ino != vm->saved.ino || st.st_size != vm->saved.size ||
+      st.st_mtim.tv_sec != vm->saved.mtime.tv_sec ||
+      st.st_mtim.tv_nsec != vm->saved.mtime.tv_nsec) {
+    close(fd);
+    return 0;
+  }
+  if (rxNextRun(vm, 0, cells, &to) == cells &&
+      st.st_size == (off_t)(cells * sizeof(CELL))) {
+    close(fd);
+    return 1;
+  }
+  lock = fd;
+  if (vm->image_fd >= 0 && fstat(vm->image_fd, &loaded) == 0 &&
+      loaded.st_dev == st.st_dev && loaded.st_ino == st.st_ino)
+    lock = vm->image_fd;
+  snprintf(journal, sizeof(journal), "%s.journal", image);
+  if (flock(lock, LOCK_EX | LOCK_NB) == 0 && rxDetachImage(vm) &&
+      rxWriteJournal(vm, journal, &st, cells)) {
+    done = 1;
+    for (a = rxNextRun(vm, 0, cells, &to); done && a < cells;
+         a = rxNextRun(vm, to, cells, &to))
+      done = rxWriteAt(fd, vm->image + a, (to - a) * sizeof(CELL),
+                       a * sizeof(CELL));
+    if (done && ftruncate(fd, cells * sizeof(CELL)) == 0 && fsync(fd) == 0) {
+      unlink(journal);
+      rxSavedAs(vm, fd, cells);
+    }
+    else
+      done = 0;
+  }
+  if (lock != fd)
+    flock(lock, LOCK_SH);
+  close(fd);
+  return done;
+}
+
+size_t rxMapImage(VM *vm, int fd) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t limit, size, length;
+  struct stat st;
+
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    return 0;
+  size = (size_t)st.st_size / sizeof(CELL);
+  rxGrowImage(vm, (size < MAX_IMAGE_SIZE) ? (long)size : MAX_IMAGE_SIZE);
+  if (vm->huge)
+    return 0;
+  size = size * sizeof(CELL);
+  limit = (size_t)vm->image_size * sizeof(CELL) / page * page;
+  length = (size + page - 1) / page * page;
+  if (length > limit)
+    length = limit;
+  if (length == 0 || mmap(vm->image, length, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    return 0;
+  vm->image_mapped = length;
+  return (size < length) ? size : length;
+}
+
 CELL rxLoadImage(VM *vm, char *image) {
   FILE *fp;
   CELL x = 0;
 
+  rxReplayJournal(image);
   if ((fp = fopen(image, "rb")) != NULL) {
-    x = fread(&vm->image, sizeof(CELL), IMAGE_SIZE, fp);
+    vm->image_fd = dup(fileno(fp));
+    flock(vm->image_fd, LOCK_SH);
+    x = rxMapImage(vm, fileno(fp)) / sizeof(CELL);
+    if (x < vm->image_size && fseek(fp, x * sizeof(CELL), SEEK_SET) == 0)
+      x += fread(vm->image + x, sizeof(CELL), vm->image_size - x, fp);
+    rxSavedAs(vm, fileno(fp), x);
     fclose(fp);
   }
   else {
@@ -270,29 +1815,157 @@ CELL rxLoadImage(VM *vm, char *image) {
   return x;
 }
 
-CELL rxSaveImage(VM *vm, char *image) {
+/* Writes the image to the file named image, returning the number of
+   cells saved, or -1 if it can't */
+long rxWriteImage(VM *vm, char *image) {
   FILE *fp;
-  CELL x = 0;
+  long x, cells = vm->image_size;
+  char temp[MAX_FILE_NAME + 9];
+  struct stat st;
+
+  if (vm->shrink != 0 && vm->image[3] >= 0 && vm->image[3] < cells)
+    cells = vm->image[3];
+  if (rxSaveChanges(vm, image, cells))
+    return cells;
+  snprintf(temp, sizeof(temp), "%s.new", image);
+  if ((fp = fopen(temp, "wb")) == NULL)
+    return -1;
+  if (stat(image, &st) == 0)
+    fchmod(fileno(fp), st.st_mode & 07777);
+
+  x = fwrite(&vm->image, sizeof(CELL), cells, fp);
+  if (fflush(fp) == 0 && fsync(fileno(fp)) == 0)
+    rxSavedAs(vm, fileno(fp), x);
+  else
+    vm->saved.known = 0;
+  if (fclose(fp) != 0 || !vm->saved.known || rename(temp, image) != 0) {
+    unlink(temp);
+    return -1;
+  }
+  rxSyncDirectory(image);
+  snprintf(temp, sizeof(temp), "%s.journal", image);
+  unlink(temp);
+  return x;
+}
 
-  if ((fp = fopen(image, "wb")) == NULL)
+CELL rxSaveImage(VM *vm, char *image) {
+  long x;
+
+  fflush(stdout);
+  rxFinishSave(vm, 1);
+  if ((x = rxWriteImage(vm, image)) < 0)
   {
     printf("Unable to save the retroImage!\n");
     rxRestoreIO(vm);
     exit(2);
   }
+  return x;
+}
 
-  if (vm->shrink == 0)
-    x = fwrite(&vm->image, sizeof(CELL), IMAGE_SIZE, fp);
-  else
-    x = fwrite(&vm->image, sizeof(CELL), vm->image[3], fp);
-  fclose(fp);
+/* Background Saves ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   Writing 3 to port 4 saves the image without stopping the VM. It
+   forks, and the child writes the image as it was at that moment (its
+   copy-on-write view of the VM's memory) while the VM runs on. Port 4
+   then holds -1, or 0 if an earlier background save is still running.
+   Query the state of the last one with -14:
 
-  return x;
+     0  none started
+     1  still running
+     2  saved
+     3  failed
+
+   The blocks changed before the fork are handed to the child, which
+   saves them as usual (see Images above), and vm->changed[] starts
+   over. When the child is done, it passes back the state of the file
+   it wrote through a pipe. If it fails, the blocks it had are marked
+   as changed again, so the next save includes them.
+
+   The image file is detached from the image first (see Images above),
+   since the child writing it in place would change the cells the VM
+   still reads from it. If that fails, the child writes a new file.
+
+   An image backed by MAP_HUGETLB pages is saved in the foreground
+   instead, as the pages the VM copies on write after a fork come from
+   the huge page pool, which may be too small. This also happens when
+   fork() fails. A save through port 4 with 1, and leaving the VM, wait
+   for a background save to finish first.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+#define SAVE_NONE    0
+#define SAVE_RUNNING 1
+#define SAVE_DONE    2
+#define SAVE_FAILED  3
+
+/* Collects the result of a background save, waiting for it if wait is
+   set. Returns 0 if it is still running. */
+int rxFinishSave(VM *vm, int wait) {
+  struct rxSaved saved;
+  size_t i;
+  pid_t pid;
+  int status;
+
+  if (vm->saver == 0)
+    return 1;
+  while ((pid = waitpid(vm->saver, &status, wait ? 0 : WNOHANG)) < 0 &&
+         errno == EINTR)
+    ;
+  if (pid == 0)
+    return 0;
+  if (pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+      read(vm->save_pipe, &saved, sizeof(saved)) == sizeof(saved)) {
+    vm->saved = saved;
+    vm->save_status = SAVE_DONE;
+  }
+  else {
+    for (i = 0; i < sizeof(vm->changed); i++)
+      vm->changed[i] |= vm->saving[i];
+    vm->save_status = SAVE_FAILED;
+  }
+  close(vm->save_pipe);
+  vm->saver = 0;
+  return 1;
+}
+
+CELL rxBackgroundSave(VM *vm, char *image) {
+  int fds[2];
+  pid_t pid;
+
+  if (!rxFinishSave(vm, 0))
+    return 0;
+  fflush(stdout);
+  rxDetachImage(vm);
+  if (vm->hugetlb == 0 && pipe(fds) == 0) {
+    if ((pid = fork()) == 0) {
+      close(fds[0]);
+      if (vm->image_mapped != 0)
+        vm->saved.known = 0;
+      if (rxWriteImage(vm, image) < 0 ||
+          write(fds[1], &vm->saved, sizeof(vm->saved)) != sizeof(vm->saved))
+        _exit(1);
+      _exit(0);
+    }
+    close(fds[1]);
+    if (pid > 0) {
+      memcpy(vm->saving, vm->changed, sizeof(vm->changed));
+      memset(vm->changed, 0, sizeof(vm->changed));
+      vm->saver = pid;
+      vm->save_pipe = fds[0];
+      vm->save_status = SAVE_RUNNING;
+      return -1;
+    }
+    close(fds[0]);
+  }
+  vm->save_status = (rxWriteImage(vm, image) < 0) ? SAVE_FAILED : SAVE_DONE;
+  return -1;
+}
+
+CELL rxSaveStatus(VM *vm) {
+  rxFinishSave(vm, 0);
+  return vm->save_status;
 }
 
 /* Environment Query ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
 void rxQueryEnvironment(VM *vm) {
-  CELL req, dest;
+  CELL req, dest, start;
   char *r;
   req = TOS;  DROP;
   dest = TOS; DROP;
@@ -300,7 +1973,9 @@ void rxQueryEnvironment(VM *vm) {
   rxGetString(vm, req);
   r = getenv(vm->request);
 
-  if (r != 0)
+  if (r != 0 && rxWritable(vm, dest, strlen(r) + 1))
+  {
+    start = dest;
     while (*r != '\0')
     {
       vm->image[dest] = *r;
@@ -308,119 +1983,672 @@ void rxQueryEnvironment(VM *vm) {
       vm->image[dest] = 0;
       r++;
     }
-  else
+    rxImageWritten(vm, start, dest - start + 1);
+  }
+  else if (rxWritable(vm, dest, 1))
+  {
     vm->image[dest] = 0;
+    rxImageWritten(vm, dest, 1);
+  }
+}
+
+/* Instrumentation ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   vm->level selects what the reference engine records. With --stats it
+   counts each opcode and the deepest stacks seen; with --stats-full or
+   --ngrams it also counts the calls made to each word and the pairs
+   and triples of instructions executed one after the other at
+   consecutive addresses. The pairs and triples are the candidates for
+   fused handlers; see tools/fuse.c.
+
+   rxInstrumentedEngine() runs rxProcessOpcode() with these around it,
+   and takes the samples for --profile (see below), so a run without
+   either uses a loop with none of this. The counters can be read by the
+   image through capability queries -16 to -18.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+#define STAT_MAX_SP  (NUM_OPS + 1)
+#define STAT_MAX_RSP (NUM_OPS + 2)
+#define STAT_TOTAL   (NUM_OPS + 3)
+
+#if RXSTATS > 1
+void rxCountNgram(VM *vm, CELL opcode) {
+  int op = rxOpClass(opcode);
+  if (IP != vm->ngram_next)
+    vm->ngram_len = 0;
+  if (vm->ngram_len >= 1)
+    vm->bigrams[vm->ngram_ops[1]][op]++;
+  if (vm->ngram_len >= 2)
+    vm->trigrams[vm->ngram_ops[0]][vm->ngram_ops[1]][op]++;
+  vm->ngram_ops[0] = vm->ngram_ops[1];
+  vm->ngram_ops[1] = op;
+  vm->ngram_len++;
+  vm->ngram_next = IP + rxOpLength(opcode);
+}
+
+void rxSaveNgrams(VM *vm, char *name) {
+  FILE *fp;
+  int x, y, z;
+
+  if ((fp = fopen(name, "w")) == NULL) {
+    printf("Unable to save the opcode profile to %s\n", name);
+    return;
+  }
+  for (x = 0; x <= NUM_OPS; x++)
+    for (y = 0; y <= NUM_OPS; y++) {
+      if (vm->bigrams[x][y])
+        fprintf(fp, "%llu %s %s\n", (unsigned long long)vm->bigrams[x][y],
+                rxOpNames[x], rxOpNames[y]);
+      for (z = 0; z <= NUM_OPS; z++)
+        if (vm->trigrams[x][y][z])
+          fprintf(fp, "%llu %s %s %s\n",
+                  (unsigned long long)vm->trigrams[x][y][z],
+                  rxOpNames[x], rxOpNames[y], rxOpNames[z]);
+    }
+  fclose(fp);
+}
+#endif
+
+/* Counter n: an opcode (NUM_OPS for calls) or one of the STAT_ values */
+uint64_t rxCounter(VM *vm, CELL n) {
+#if RXSTATS > 0
+  uint64_t total = 0;
+  int i;
+
+  if (n >= 0 && n <= NUM_OPS)
+    return vm->stats[n];
+  if (n == STAT_MAX_SP)
+    return vm->max_sp;
+  if (n == STAT_MAX_RSP)
+    return vm->max_rsp;
+  if (n == STAT_TOTAL) {
+    for (i = 0; i < NUM_OPS; i++)
+      total += vm->stats[i];
+    return total;
+  }
+#endif
+  return 0;
+}
+
+uint64_t rxCallCount(VM *vm, CELL a) {
+#if RXSTATS > 1
+  if (a >= 0 && a < vm->image_size)
+    return vm->calls[a];
+#endif
+  return 0;
+}
+
+/* Profiler ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   With --profile filename, a timer raises SIGPROF every
+   PROFILE_INTERVAL microseconds of CPU time. The handler only sets
+   HOOK_SAMPLE in vm->hooks. The threaded engine checks this on calls,
+   and the reference engine after each instruction; either then passes
+   the address of the next instruction and the address stack to
+   rxSample(). Identical stacks are counted together in a hash
+   table of PROFILE_BUCKETS chains.
+
+   At exit, each address is resolved to the word containing it: the one
+   with the highest xt at or below it, from the headers linked from last
+   (image[2]). Address stack entries not pointing at a call were put
+   there by PUSH, and are left out. The stacks are then written in the
+   collapsed format read by flamegraph.pl: the names of the words from
+   the outermost in, separated by semicolons, then the count. Semicolons
+   in names are written as colons.
+
+   Native code is not checked for samples, so profiling turns off the
+   JIT compiler and any translated code.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+#define PROFILE_INTERVAL  1000
+#define PROFILE_BUCKETS   4096
+
+struct rxStack {
+  struct rxStack *next;
+  uint64_t count;
+  unsigned hash;
+  int depth;
+  CELL *frames;
+};
+
+struct rxWord {
+  CELL xt, header;
+};
+
+struct rxLine {
+  char *text;
+  uint64_t count;
+};
+
+static VM *rxProfiled;
+
+void rxProfileSignal(int sig) {
+  (void)sig;
+  if (rxProfiled != NULL)
+    rxProfiled->hooks |= HOOK_SAMPLE;
+}
+
+void rxSample(VM *vm, CELL ip, CELL rsp) {
+  CELL frames[ADDRESSES + 1], a;
+  struct rxStack *s;
+  unsigned hash = 2166136261u;
+  int i, depth = 0;
+
+  vm->hooks &= ~HOOK_SAMPLE;
+  if (rsp >= ADDRESSES)
+    rsp = ADDRESSES - 1;
+  for (i = 1; i <= rsp; i++) {
+    a = vm->address[i];
+    if (a >= 0 && a < vm->image_size && rxOpClass(vm->image[a]) == VM_CALL)
+      frames[depth++] = a;
+  }
+  frames[depth++] = ip;
+  for (i = 0; i < depth; i++)
+    hash = (hash ^ (unsigned)frames[i]) * 16777619u;
+
+  for (s = vm->stacks[hash % PROFILE_BUCKETS]; s; s = s->next)
+    if (s->hash == hash && s->depth == depth &&
+        memcmp(s->frames, frames, depth * sizeof(CELL)) == 0)
+      break;
+  if (s == NULL) {
+    if ((s = malloc(sizeof(struct rxStack))) == NULL ||
+        (s->frames = malloc(depth * sizeof(CELL))) == NULL) {
+      free(s);
+      return;
+    }
+    memcpy(s->frames, frames, depth * sizeof(CELL));
+    s->hash = hash;
+    s->depth = depth;
+    s->count = 0;
+    s->next = vm->stacks[hash % PROFILE_BUCKETS];
+    vm->stacks[hash % PROFILE_BUCKETS] = s;
+  }
+  s->count++;
+  vm->samples++;
+}
+
+int rxByXt(const void *a, const void *b) {
+  const struct rxWord *x = a, *y = b;
+  return (x->xt > y->xt) - (x->xt < y->xt);
+}
+
+int rxByLine(const void *a, const void *b) {
+  const struct rxLine *x = a, *y = b;
+  return strcmp(x->text, y->text);
+}
+
+/* The index of the word containing address a, or -1 */
+int rxWordAt(struct rxWord *words, int count, CELL a) {
+  int lo = 0, hi = count - 1, mid, found = -1;
+
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    if (words[mid].xt <= a) {
+      found = mid;
+      lo = mid + 1;
+    } else
+      hi = mid - 1;
+  }
+  return found;
+}
+
+/* Build the line for a stack. An address stack entry pointing at a call
+   is taken as a return address if the call is to the word holding the
+   next frame in, or if the next entry out calls the word holding it
+   (the next frame in is lost when the call it made was a tail call).
+   Anything else is a value that happens to look like one. */
+void rxStackLine(VM *vm, struct rxWord *words, int count, struct rxStack *s,
+                 char *line, size_t size) {
+  int in, out, i, n = 0, w[ADDRESSES + 1], keep[ADDRESSES + 1];
+  char *p;
+
+  for (i = 0; i < s->depth; i++)
+    w[i] = rxWordAt(words, count, s->frames[i]);
+  keep[s->depth - 1] = 1;
+  in = w[s->depth - 1];
+  for (i = s->depth - 2; i >= 0; i--) {
+    out = (i > 0) ? rxWordAt(words, count, vm->image[s->frames[i - 1]]) : -1;
+    keep[i] = rxWordAt(words, count, vm->image[s->frames[i]]) == in ||
+              (out == w[i] && out >= 0) || (i == 0 && w[i] >= 0);
+    if (keep[i])
+      in = w[i];
+  }
+
+  line[0] = 0;
+  for (i = 0; i < s->depth; i++) {
+    if (!keep[i])
+      continue;
+    if (w[i] < 0)
+      strcpy(vm->request, "?");
+    else
+      rxGetString(vm, words[w[i]].header + 3);
+    for (p = vm->request; *p; p++)
+      if (*p == ';')
+        *p = ':';
+    n += snprintf(line + n, (size_t)n < size ? size - n : 0, "%s%s",
+                  n ? ";" : "", vm->request);
+  }
+}
+
+void rxSaveProfile(VM *vm) {
+  struct itimerval off;
+  struct rxWord *words;
+  struct rxLine *lines;
+  struct rxStack *s;
+  char line[8192];
+  uint64_t total;
+  int count = 0, stacks = 0, i, j;
+  CELL h;
+  FILE *fp;
+
+  memset(&off, 0, sizeof(off));
+  setitimer(ITIMER_PROF, &off, NULL);
+  rxProfiled = NULL;
+
+  for (h = vm->image[2]; h > 0 && h < vm->image_size - 3 &&
+       count < vm->image_size;
+       h = vm->image[h])
+    count++;
+  for (i = 0; i < PROFILE_BUCKETS; i++)
+    for (s = vm->stacks[i]; s; s = s->next)
+      stacks++;
+  words = malloc((count + 1) * sizeof(struct rxWord));
+  lines = malloc((stacks + 1) * sizeof(struct rxLine));
+  if (words == NULL || lines == NULL || (fp = fopen(vm->profile, "w")) == NULL) {
+    fprintf(stderr, "Unable to save the profile to %s\n", vm->profile);
+    free(words);
+    free(lines);
+    return;
+  }
+
+  for (i = 0, h = vm->image[2]; i < count; i++, h = vm->image[h]) {
+    words[i].xt = vm->image[h + 2];
+    words[i].header = h;
+  }
+  qsort(words, count, sizeof(struct rxWord), rxByXt);
+
+  /* Different stacks can resolve to the same words, so the lines are
+     sorted to merge them */
+  for (i = j = 0; i < PROFILE_BUCKETS; i++)
+    for (s = vm->stacks[i]; s; s = s->next) {
+      rxStackLine(vm, words, count, s, line, sizeof(line));
+      if ((lines[j].text = malloc(strlen(line) + 1)) != NULL) {
+        strcpy(lines[j].text, line);
+        lines[j++].count = s->count;
+      }
+    }
+  stacks = j;
+  qsort(lines, stacks, sizeof(struct rxLine), rxByLine);
+
+  for (i = 0; i < stacks; i = j) {
+    for (total = 0, j = i; j < stacks && strcmp(lines[i].text, lines[j].text) == 0; j++)
+      total += lines[j].count;
+    fprintf(fp, "%s %llu\n", lines[i].text, (unsigned long long)total);
+  }
+  fclose(fp);
+  for (i = 0; i < stacks; i++)
+    free(lines[i].text);
+  free(lines);
+  free(words);
+}
+
+/* For runs ended by exit(), such as at the end of the input */
+void rxProfileAtExit(void) {
+  if (rxProfiled != NULL)
+    rxSaveProfile(rxProfiled);
+}
+
+int rxStartProfile(VM *vm) {
+  struct sigaction sa;
+  struct itimerval timer;
+
+  if ((vm->stacks = calloc(PROFILE_BUCKETS, sizeof(struct rxStack *))) == NULL)
+    return 0;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = rxProfileSignal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGPROF, &sa, NULL) != 0)
+    return 0;
+  timer.it_interval.tv_sec = timer.it_value.tv_sec = 0;
+  timer.it_interval.tv_usec = timer.it_value.tv_usec = PROFILE_INTERVAL;
+  if (setitimer(ITIMER_PROF, &timer, NULL) != 0)
+    return 0;
+  rxProfiled = vm;
+  atexit(rxProfileAtExit);
+  return 1;
+}
+
+/* Device I/O Handler ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   Devices are registered by port in vm->devices. OUT marks the port it
+   writes in vm->dirty, and WAIT runs the devices of the marked ports
+   that have one (those set in vm->attached), lowest port first, so the
+   cost of a WAIT doesn't grow with the number of devices. Ports are
+   allocated as they are written, up to MAX_PORTS.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+#define PORT_BITS (8 * sizeof(unsigned long))
+
+/* The core devices are inlined into rxDeviceHandler() */
+#ifdef __GNUC__
+#define CORE_DEVICE static inline __attribute__((always_inline)) void
+#else
+#define CORE_DEVICE static void
+#endif
+
+struct rxDevice {
+  void (*run)(VM *vm);
+};
+
+int rxGrowPorts(VM *vm, CELL port) {
+  CELL count = vm->port_count, i;
+  CELL *ports;
+  struct rxDevice *devices;
+  unsigned long *dirty, *attached;
+  size_t words;
+
+  if (port < count)
+    return 1;
+  if (port >= MAX_PORTS)
+    return 0;
+  while (count <= port)
+    count = (count < PORTS) ? PORTS : count * 2;
+  if (count > MAX_PORTS)
+    count = MAX_PORTS;
+  words = (count + PORT_BITS - 1) / PORT_BITS;
+  if ((ports = realloc(vm->ports, count * sizeof(CELL))) != NULL)
+    vm->ports = ports;
+  if ((devices = realloc(vm->devices, count * sizeof(*devices))) != NULL)
+    vm->devices = devices;
+  if ((dirty = realloc(vm->dirty, words * sizeof(*dirty))) != NULL)
+    vm->dirty = dirty;
+  if ((attached = realloc(vm->attached, words * sizeof(*attached))) != NULL)
+    vm->attached = attached;
+  if (ports == NULL || devices == NULL || dirty == NULL || attached == NULL)
+    return 0;
+  for (i = vm->port_count; i < count; i++) {
+    ports[i] = 0;
+    devices[i].run = NULL;
+  }
+  for (i = (vm->port_count + PORT_BITS - 1) / PORT_BITS; i < (CELL)words; i++)
+    dirty[i] = attached[i] = 0;
+  vm->port_count = count;
+  return 1;
+}
+
+void rxRegisterDevice(VM *vm, CELL port, void (*run)(VM *vm)) {
+  unsigned long bit = 1UL << (port % PORT_BITS);
+
+  if (port <= 0 || !rxGrowPorts(vm, port))
+    return;
+  vm->devices[port].run = run;
+  if (run != NULL)
+    vm->attached[port / PORT_BITS] |= bit;
+  else
+    vm->attached[port / PORT_BITS] &= ~bit;
+}
+
+CELL rxPortIn(VM *vm, CELL port) {
+  CELL value = 0;
+  if (port >= 0 && port < vm->port_count) {
+    value = vm->ports[port];
+    vm->ports[port] = 0;
+  }
+  return value;
 }
 
-/* Device I/O Handler ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
-void rxDeviceHandler(VM *vm) {
-  struct winsize w;
-  if (vm->ports[0] != 1) {
-    /* Input */
-    if (vm->ports[0] == 0 && vm->ports[1] == 1) {
-      vm->ports[1] = rxReadConsole(vm);
-      vm->ports[0] = 1;
-    }
+void rxPortOut(VM *vm, CELL port, CELL value) {
+  vm->ports[0] = 0;
+  if (port < 0 || !rxGrowPorts(vm, port))
+    return;
+  vm->ports[port] = value;
+  vm->dirty[port / PORT_BITS] |= 1UL << (port % PORT_BITS);
+}
 
-    /* Output (character generator) */
-    if (vm->ports[2] == 1) {
-      rxWriteConsole(TOS); DROP
-      vm->ports[2] = 0;
-      vm->ports[0] = 1;
-    }
+/* The lowest marked port in bits */
+int rxLowestPort(unsigned long bits) {
+#ifdef __GNUC__
+  return __builtin_ctzl(bits);
+#else
+  int i;
+  for (i = 0; (bits & 1) == 0; i++)
+    bits >>= 1;
+  return i;
+#endif
+}
 
-    /* File IO and Image Saving */
-    if (vm->ports[4] != 0) {
-      vm->ports[0] = 1;
-      switch (vm->ports[4]) {
-        case  1: rxSaveImage(vm, vm->filename);
-                 vm->ports[4] = 0;
-                 break;
-        case  2: rxAddInputSource(vm);
-                 vm->ports[4] = 0;
-                 break;
-        case -1: vm->ports[4] = rxOpenFile(vm);
-                 break;
-        case -2: vm->ports[4] = rxReadFile(vm);
-                 break;
-        case -3: vm->ports[4] = rxWriteFile(vm);
-                 break;
-        case -4: vm->ports[4] = rxCloseFile(vm);
-                 break;
-        case -5: vm->ports[4] = rxGetFilePosition(vm);
-                 break;
-        case -6: vm->ports[4] = rxSetFilePosition(vm);
-                 break;
-        case -7: vm->ports[4] = rxGetFileSize(vm);
-                 break;
-        case -8: vm->ports[4] = rxDeleteFile(vm);
-                 break;
-        default: vm->ports[4] = 0;
-      }
+/* Input */
+CORE_DEVICE rxInputDevice(VM *vm) {
+  if (vm->ports[0] == 0 && vm->ports[1] == 1) {
+    vm->ports[1] = rxReadConsole(vm);
+    vm->ports[0] = 1;
+  }
+  if (vm->ports[0] == 0 && vm->ports[1] == 2) {
+    rxAcceptToken(vm);
+    vm->ports[1] = 0;
+    vm->ports[0] = 1;
+  }
+}
+
+/* Output (character generator) */
+CORE_DEVICE rxOutputDevice(VM *vm) {
+  if (vm->ports[2] != 0) {
+    switch (vm->ports[2]) {
+      case 1: rxWriteConsole(TOS); DROP
+              break;
+      case 2: rxWriteConsoleString(vm, TOS); DROP
+              break;
+      case 3: rxWriteConsoleRange(vm, NOS, NOS + TOS); DROP DROP
+              break;
+      case 4: fflush(stdout);
+              break;
     }
+    vm->ports[2] = 0;
+    vm->ports[0] = 1;
+  }
+}
 
-    /* Capabilities */
-    if (vm->ports[5] != 0) {
-      vm->ports[0] = 1;
-      switch(vm->ports[5]) {
-        case -1:  vm->ports[5] = IMAGE_SIZE;
-                  break;
-        case -2:  vm->ports[5] = 0;
-                  break;
-        case -3:  vm->ports[5] = 0;
-                  break;
-        case -4:  vm->ports[5] = 0;
-                  break;
-        case -5:  vm->ports[5] = SP;
-                  break;
-        case -6:  vm->ports[5] = RSP;
-                  break;
-        case -7:  vm->ports[5] = 0;
-                  break;
-        case -8:  vm->ports[5] = time(NULL);
-                  break;
-        case -9:  vm->ports[5] = 0;
-                  IP = IMAGE_SIZE;
-                  break;
-        case -10: vm->ports[5] = 0;
-                  rxQueryEnvironment(vm);
-                  break;
-        case -11: ioctl(0, TIOCGWINSZ, &w);
-                  vm->ports[5] = w.ws_col;
-                  break;
-        case -12: ioctl(0, TIOCGWINSZ, &w);
-                  vm->ports[5] = w.ws_row;
-                  break;
-        case -13: vm->ports[5] = CELLSIZE;
-                  break;
-        case -14: vm->ports[5] = VM_ENDIAN;
-                  break;
-        case -15: vm->ports[5] = -1;
-                  break;
-        default:  vm->ports[5] = 0;
-      }
+/* File IO and Image Saving */
+CORE_DEVICE rxFileDevice(VM *vm) {
+  if (vm->ports[4] != 0) {
+    vm->ports[0] = 1;
+    switch (vm->ports[4]) {
+      case  1: rxSaveImage(vm, vm->filename);
+               vm->ports[4] = 0;
+               break;
+      case  2: rxAddInputSource(vm);
+               vm->ports[4] = 0;
+               break;
+      case  3: vm->ports[4] = rxBackgroundSave(vm, vm->filename);
+               break;
+      case -1: vm->ports[4] = rxOpenFile(vm);
+               break;
+      case -2: vm->ports[4] = rxReadFile(vm);
+               break;
+      case -3: vm->ports[4] = rxWriteFile(vm);
+               break;
+      case -4: vm->ports[4] = rxCloseFile(vm);
+               break;
+      case -5: vm->ports[4] = rxGetFilePosition(vm);
+               break;
+      case -6: vm->ports[4] = rxSetFilePosition(vm);
+               break;
+      case -7: vm->ports[4] = rxGetFileSize(vm);
+               break;
+      case -8: vm->ports[4] = rxDeleteFile(vm);
+               break;
+      case -9: vm->ports[4] = rxReadBlock(vm);
+               break;
+      case -10: vm->ports[4] = rxWriteBlock(vm);
+               break;
+      case -11: vm->ports[4] = rxReadLine(vm);
+               break;
+      case -12: vm->ports[4] = rxMapFile(vm);
+               break;
+      case -13: vm->ports[4] = rxUnmapFile(vm);
+               break;
+      case -14: vm->ports[4] = rxSaveStatus(vm);
+               break;
+      default: vm->ports[4] = 0;
     }
+  }
+}
+
+#ifndef RXNOASYNC
+/* Asynchronous File IO */
+void rxAsyncPort(VM *vm) {
+  if (vm->ports[9] != 0) {
+    vm->ports[9] = rxAsyncDevice(vm, vm->ports[9]);
+    vm->ports[0] = 1;
+  }
+}
+#endif
 
-    if (vm->ports[8] != 0) {
-      switch (vm->ports[8]) {
-        case 1: vm->ports[8] = 0;
-                printf("\e[%d;%dH", NOS, TOS);
-                DROP; DROP;
+/* Capabilities */
+CORE_DEVICE rxCapabilities(VM *vm) {
+  struct winsize w;
+  if (vm->ports[5] != 0) {
+    vm->ports[0] = 1;
+    switch(vm->ports[5]) {
+      case -1:  vm->ports[5] = vm->image_size;
+                break;
+      case -2:  vm->ports[5] = 0;
+                break;
+      case -3:  vm->ports[5] = 0;
+                break;
+      case -4:  vm->ports[5] = 0;
+                break;
+      case -5:  vm->ports[5] = SP;
+                break;
+      case -6:  vm->ports[5] = RSP;
+                break;
+      case -7:  vm->ports[5] = 0;
+                break;
+      case -8:  vm->ports[5] = time(NULL);
+                break;
+      case -9:  vm->ports[5] = 0;
+                fflush(stdout);
+                IP = MAX_IMAGE_SIZE;
+                break;
+      case -10: vm->ports[5] = 0;
+                rxQueryEnvironment(vm);
                 break;
-        case 2: vm->ports[8] = 0;
-                printf("\e[3%dm", TOS);
+      case -11: ioctl(0, TIOCGWINSZ, &w);
+                vm->ports[5] = w.ws_col;
+                break;
+      case -12: ioctl(0, TIOCGWINSZ, &w);
+                vm->ports[5] = w.ws_row;
+                break;
+      case -13: vm->ports[5] = CELLSIZE;
+                break;
+      case -14: vm->ports[5] = VM_ENDIAN;
+                break;
+      case -15: vm->ports[5] = -1;
+                break;
+      case -16: vm->ports[5] = vm->level;
+                break;
+      case -17: vm->ports[5] = (CELL)rxCounter(vm, TOS);
                 DROP;
                 break;
-        case 3: vm->ports[8] = 0;
-                printf("\e[4%dm", TOS);
+      case -18: vm->ports[5] = (CELL)rxCallCount(vm, TOS);
                 DROP;
                 break;
-        case 4: vm->ports[8] = 0;
+      case -19: vm->ports[5] = -1;
                 break;
-        default: vm->ports[8] = 0;
-      }
+      case -20: vm->ports[5] = -1;
+                break;
+      case -21: vm->ports[5] = -1;
+                break;
+      case -22: vm->ports[5] = rxPageCells();
+                break;
+#ifndef RXNOASYNC
+      case -23: vm->ports[5] = -1;
+                break;
+#endif
+      case -24: vm->ports[5] = rxGrowImage(vm, TOS);
+                DROP;
+                break;
+      case -25: vm->ports[5] = MAX_IMAGE_SIZE;
+                break;
+      default:  vm->ports[5] = 0;
+    }
+  }
+}
+
+/* Enhanced Text Console */
+CORE_DEVICE rxConsoleDevice(VM *vm) {
+  if (vm->ports[8] != 0) {
+    switch (vm->ports[8]) {
+      case 1: vm->ports[8] = 0;
+              printf("\e[%d;%dH", NOS, TOS);
+              DROP; DROP;
+              break;
+      case 2: vm->ports[8] = 0;
+              printf("\e[3%dm", TOS);
+              DROP;
+              break;
+      case 3: vm->ports[8] = 0;
+              printf("\e[4%dm", TOS);
+              DROP;
+              break;
+      case 4: vm->ports[8] = 0;
+              break;
+      default: vm->ports[8] = 0;
+    }
+  }
+}
+
+/* The core devices are called directly when they are the ones
+   registered, rather than through the table */
+static void rxRunDevice(VM *vm, CELL port) {
+  void (*run)(VM *vm) = vm->devices[port].run;
+
+  switch (port) {
+    case 1: if (run == rxInputDevice) { rxInputDevice(vm); return; } break;
+    case 2: if (run == rxOutputDevice) { rxOutputDevice(vm); return; } break;
+    case 4: if (run == rxFileDevice) { rxFileDevice(vm); return; } break;
+    case 5: if (run == rxCapabilities) { rxCapabilities(vm); return; } break;
+    case 8: if (run == rxConsoleDevice) { rxConsoleDevice(vm); return; } break;
+  }
+  run(vm);
+}
+
+void rxRunDirtyPorts(VM *vm) {
+  size_t i, words = (vm->port_count + PORT_BITS - 1) / PORT_BITS;
+  unsigned long bits;
+
+  for (i = 0; i < words; i++)
+    while ((bits = vm->dirty[i] & vm->attached[i]) != 0) {
+      vm->dirty[i] = bits & (bits - 1);
+      vm->devices[i * PORT_BITS + rxLowestPort(bits)].run(vm);
     }
+}
+
+/* Ports written while ports[0] is 1 are dropped, as WAIT does nothing
+   then. Usually one device (and maybe some ports without one, like 3)
+   has been written, and it is run without walking the bitmap. */
+void rxDeviceHandler(VM *vm) {
+  unsigned long bits = vm->dirty[0] & vm->attached[0];
+
+  if (vm->ports[0] == 1) {
+    memset(vm->dirty, 0, (vm->port_count + PORT_BITS - 1) / PORT_BITS *
+                         sizeof(*vm->dirty));
+    return;
   }
+  if ((bits & (bits - 1)) == 0 && (size_t)vm->port_count <= PORT_BITS) {
+    vm->dirty[0] = 0;
+    if (bits != 0)
+      rxRunDevice(vm, rxLowestPort(bits));
+    return;
+  }
+  rxRunDirtyPorts(vm);
+}
+
+void rxInitDevices(VM *vm) {
+  rxGrowPorts(vm, PORTS - 1);
+  rxRegisterDevice(vm, 1, rxInputDevice);
+  rxRegisterDevice(vm, 2, rxOutputDevice);
+  rxRegisterDevice(vm, 4, rxFileDevice);
+  rxRegisterDevice(vm, 5, rxCapabilities);
+  rxRegisterDevice(vm, 8, rxConsoleDevice);
+#ifndef RXNOASYNC
+  rxRegisterDevice(vm, 9, rxAsyncPort);
+#endif
 }
 
 /* The VM ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
@@ -428,11 +2656,6 @@ void rxProcessOpcode(VM *vm) {
   CELL a, b, opcode;
   opcode = vm->image[IP];
 
-  if (opcode > NUM_OPS)
-    vm->stats[NUM_OPS]++;
-  else
-    vm->stats[opcode]++;
-
   switch(opcode) {
     case VM_NOP:
          break;
@@ -440,14 +2663,10 @@ void rxProcessOpcode(VM *vm) {
          SP++;
          IP++;
          TOS = vm->image[IP];
-         if (vm->max_sp < SP)
-           vm->max_sp = SP;
          break;
     case VM_DUP:
          SP++;
          vm->data[SP] = NOS;
-         if (vm->max_sp < SP)
-           vm->max_sp = SP;
          break;
     case VM_DROP:
          DROP
@@ -461,8 +2680,6 @@ void rxProcessOpcode(VM *vm) {
          RSP++;
          TORS = TOS;
          DROP
-         if (vm->max_rsp < RSP)
-           vm->max_rsp = RSP;
          break;
     case VM_POP:
          SP++;
@@ -480,8 +2697,8 @@ void rxProcessOpcode(VM *vm) {
     case VM_JUMP:
          IP++;
          IP = vm->image[IP] - 1;
-         if (IP < 0)
-           IP = IMAGE_SIZE;
+         if (IP < 0 || IP >= vm->image_size)
+           IP = MAX_IMAGE_SIZE;
          else {
            if (vm->image[IP+1] == 0)
              IP++;
@@ -492,8 +2709,8 @@ void rxProcessOpcode(VM *vm) {
     case VM_RETURN:
          IP = TORS;
          RSP--;
-         if (IP < 0)
-           IP = IMAGE_SIZE;
+         if (IP < 0 || IP >= vm->image_size)
+           IP = MAX_IMAGE_SIZE;
          else {
            if (vm->image[IP+1] == 0)
              IP++;
@@ -526,10 +2743,14 @@ void rxProcessOpcode(VM *vm) {
          DROP DROP
          break;
     case VM_FETCH:
-         TOS = vm->image[TOS];
+         TOS = (TOS >= 0 && TOS < vm->image_size) ? vm->image[TOS] : 0;
          break;
     case VM_STORE:
-         vm->image[TOS] = NOS;
+         if (TOS >= 0 && TOS < vm->store_limit) {
+           CHANGED(TOS)
+           vm->image[TOS] = NOS;
+         } else
+           rxStoreOutside(vm, TOS, NOS);
          DROP DROP
          break;
     case VM_ADD:
@@ -593,13 +2814,10 @@ void rxProcessOpcode(VM *vm) {
          TOS -= 1;
          break;
     case VM_IN:
-         a = TOS;
-         TOS = vm->ports[a];
-         vm->ports[a] = 0;
+         TOS = rxPortIn(vm, TOS);
          break;
     case VM_OUT:
-         vm->ports[0] = 0;
-         vm->ports[TOS] = NOS;
+         rxPortOut(vm, TOS, NOS);
          DROP DROP
          break;
     case VM_WAIT:
@@ -610,78 +2828,1033 @@ void rxProcessOpcode(VM *vm) {
          TORS = IP;
          IP = vm->image[IP] - 1;
 
-         if (IP < 0)
-           IP = IMAGE_SIZE;
+         if (IP < 0 || IP >= vm->image_size)
+           IP = MAX_IMAGE_SIZE;
          else {
            if (vm->image[IP+1] == 0)
              IP++;
            if (vm->image[IP+1] == 0)
              IP++;
          }
-         if (vm->max_rsp < RSP)
-           vm->max_rsp = RSP;
          break;
   }
   vm->ports[3] = 1;
 }
 
+void rxInstrumentedEngine(VM *vm) {
+#if RXSTATS > 0
+  CELL opcode;
+#endif
+
+  for (IP = 0; IP < vm->image_size; IP++) {
+#if RXSTATS > 0
+    opcode = vm->image[IP];
+    if (vm->level >= STATS_COUNTS)
+      vm->stats[rxOpClass(opcode)]++;
+#endif
+#if RXSTATS > 1
+    if (vm->level >= STATS_FULL) {
+      rxCountNgram(vm, opcode);
+      if (opcode >= NUM_OPS && opcode < vm->image_size)
+        vm->calls[opcode]++;
+    }
+#endif
+    rxProcessOpcode(vm);
+#if RXSTATS > 0
+    if (SP > 0 && vm->max_sp < (uint64_t)SP)
+      vm->max_sp = SP;
+    if (RSP > 0 && vm->max_rsp < (uint64_t)RSP)
+      vm->max_rsp = RSP;
+#endif
+    if (vm->hooks & HOOK_SAMPLE)
+      rxSample(vm, IP + 1, RSP);
+  }
+}
+
+/* JIT Compiler ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   With --jit, calls made by the threaded engine are counted for each
+   destination. Once one has been called JIT_THRESHOLD times, the code
+   reachable from it (up to JIT_WINDOW cells on) is translated to x86-64
+   by pasting together a fixed template for each instruction.
+
+   The native code works directly on the VM stacks. TOS is kept in ebx,
+   r12 and r13 point to data[SP] and address[RSP], r14 to the image and
+   r15 to the bottom of the data stack. rbp points to a rxJitState,
+   through which the code reaches the entry table and the C helpers.
+
+   Calls push their return address on the VM's address stack, as the
+   interpreter does, and continue at the native entry for the
+   destination. Native calls also push a frame on the machine stack:
+   the native return address, and a key made of the VM one and its
+   slot on the address stack. A return matching the key of the top
+   frame pops it with a ret, which keeps the processor's return
+   prediction working. Frames are only hints. Those whose slot has
+   been popped or rewritten (as done by quotes) are dropped on the next
+   return, and all are dropped when the code exits or there are too
+   many.
+
+   Short words without branches (such as do, and the code starting a
+   quote) are copied into their callers. Where they return somewhere
+   other than the caller, the jump is then made from the call site,
+   which predicts far better than one shared by all callers.
+
+   Other returns, and branches leaving the translated region, look up
+   the entry for their destination. The code goes back to the
+   interpreter (returning the IP to resume at) when there is no entry
+   yet, on IN, OUT and WAIT, and on anything that the interpreter would
+   halt on or handle in some other way.
+
+   Stores go through rxJitStore(), so they invalidate the decoded
+   instructions. A store to a cell that has been translated throws
+   away all of the native code, and leaves the native code at once.
+   The buffer is only reused once control is back in the interpreter.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+#ifdef RXJIT
+#define JIT_BUFFER    (16 * 1024 * 1024)
+#define JIT_WINDOW    1024
+#define JIT_INLINE    8
+#define JIT_DEPTH     2
+#define JIT_REGION    (JIT_WINDOW * 2 * 128)
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 64
+#endif
+
+struct rxJitState {
+  CELL tos, scratch, size;
+  CELL *sp, *rsp, *image, *data, *address;
+  void **entry;
+  VM *vm;
+  void *frame, *base, *limit;
+  void *(*lookup)(VM *, CELL);
+  int (*store)(VM *, CELL, CELL);
+};
+
+struct rxJitRegion {
+  CELL start, end;
+  int depth, inlined;
+  char reached[JIT_WINDOW];
+  long label[JIT_WINDOW];
+  int fixups;
+  struct { long at; CELL ip; int exit; } fixup[JIT_WINDOW * 4];
+};
+
+#define EMIT(s)  rxJitEmit(vm, s, sizeof(s) - 1)
+#define FIELD(f) rxJitByte(vm, offsetof(struct rxJitState, f))
+
+void rxJitEmit(VM *vm, const char *bytes, int n) {
+  memcpy(vm->jit_code + vm->jit_used, bytes, n);
+  vm->jit_used += n;
+}
+
+void rxJitByte(VM *vm, int x) {
+  char c = x;
+  rxJitEmit(vm, &c, 1);
+}
+
+void rxJitCell(VM *vm, int32_t x) {
+  rxJitEmit(vm, (char *)&x, 4);
+}
+
+/* Branch to an offset in the buffer */
+void rxJitBranch(VM *vm, const char *op, int n, long to) {
+  rxJitEmit(vm, op, n);
+  rxJitCell(vm, to - (vm->jit_used + 4));
+}
+
+/* Branch to the code for ip, or (if exit is set, or ip is not part of
+   the region) back to the interpreter to run it. Patched later. */
+void rxJitGoto(VM *vm, struct rxJitRegion *r, const char *op, int n,
+               CELL ip, int exit) {
+  rxJitEmit(vm, op, n);
+  r->fixup[r->fixups].at = vm->jit_used;
+  r->fixup[r->fixups].ip = ip;
+  r->fixup[r->fixups].exit = exit;
+  r->fixups++;
+  rxJitCell(vm, 0);
+}
+
+void rxJitDup(VM *vm) {
+  EMIT("\x41\x89\x1c\x24");                  /* mov [r12], ebx     */
+  EMIT("\x49\x83\xc4\x04");                  /* add r12, 4         */
+}
+
+void rxJitDrop(VM *vm) {
+  EMIT("\x49\x83\xec\x04");                  /* sub r12, 4         */
+  EMIT("\x4d\x39\xfc");                      /* cmp r12, r15       */
+  rxJitBranch(vm, "\x0f\x82", 2, vm->jit_underflow);
+  EMIT("\x41\x8b\x1c\x24");                  /* mov ebx, [r12]     */
+}
+
+/* eax = the address popped from the address stack */
+void rxJitPopAddress(VM *vm) {
+  EMIT("\x41\x8b\x45\x00");                  /* mov eax, [r13]     */
+  EMIT("\x49\x83\xed\x04");                  /* sub r13, 4         */
+}
+
+void rxJitFlush(VM *vm) {
+  if (vm->jit_lo <= vm->jit_hi) {
+    memset(vm->jit_entry + vm->jit_lo, 0,
+           (vm->jit_hi - vm->jit_lo + 1) * sizeof(void *));
+    memset(vm->jit_covered + vm->jit_lo, 0, vm->jit_hi - vm->jit_lo);
+  }
+  vm->jit_lo = MAX_IMAGE_SIZE;
+  vm->jit_hi = 0;
+  vm->jit_stale = 1;
+}
+
+int rxJitStore(VM *vm, CELL a, CELL value) {
+  int covered = vm->jit_covered[a];
+  if (a >= vm->store_limit && rxReadOnly(vm, a, 1))
+    return 0;
+  rxInvalidate(vm, a, value);
+  vm->image[a] = value;
+  return covered;
+}
+
+/* The shared entry and exit sequences at the start of the buffer */
+int rxJitInit(VM *vm) {
+  long again;
+
+  vm->jit_code = mmap(NULL, JIT_BUFFER, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (vm->jit_code == MAP_FAILED)
+    return 0;
+
+  /* CELL enter(void *code, struct rxJitState *state) */
+  EMIT("\x55\x53\x41\x54\x41\x55\x41\x56\x41\x57");  /* push rbp ... r15 */
+  EMIT("\x48\x83\xec\x08");                  /* sub rsp, 8         */
+  EMIT("\x48\x89\xf5");                      /* mov rbp, rsi       */
+  EMIT("\x48\x89\x65"); FIELD(frame);        /* mov [rbp+frame], rsp */
+  EMIT("\x6a\xfe\x6a\xfe\x6a\xfe\x6a\xfe");  /* push -2 (x4), two  */
+  EMIT("\x48\x89\x65"); FIELD(base);         /* frames never matched */
+  EMIT("\x48\x8d\x84\x24"); rxJitCell(vm, -32 * ADDRESSES);
+  EMIT("\x48\x89\x45"); FIELD(limit);        /* mov [rbp+limit], rax */
+  EMIT("\x8b\x5d");     FIELD(tos);          /* mov ebx, [rbp+tos] */
+  EMIT("\x4c\x8b\x65"); FIELD(sp);           /* mov r12, [rbp+sp]  */
+  EMIT("\x4c\x8b\x6d"); FIELD(rsp);          /* mov r13, [rbp+rsp] */
+  EMIT("\x4c\x8b\x75"); FIELD(image);        /* mov r14, ...       */
+  EMIT("\x4c\x8b\x7d"); FIELD(data);         /* mov r15, ...       */
+  EMIT("\xff\xe7");                          /* jmp rdi            */
+
+  /* Leave with the IP to resume at in eax */
+  vm->jit_exit = vm->jit_used;
+  EMIT("\x48\x8b\x65"); FIELD(frame);        /* mov rsp, [rbp+frame] */
+  EMIT("\x89\x5d");     FIELD(tos);          /* mov [rbp+tos], ebx */
+  EMIT("\x4c\x89\x65"); FIELD(sp);           /* mov [rbp+sp], r12  */
+  EMIT("\x4c\x89\x6d"); FIELD(rsp);          /* mov [rbp+rsp], r13 */
+  EMIT("\x48\x83\xc4\x08");                  /* add rsp, 8         */
+  EMIT("\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5b\x5d\xc3");
+
+  vm->jit_underflow = vm->jit_used;
+  EMIT("\x4d\x89\xfc");                      /* mov r12, r15       */
+  vm->jit_halt = vm->jit_used;
+  EMIT("\xb8"); rxJitCell(vm, MAX_IMAGE_SIZE); /* mov eax, MAX_IMAGE_SIZE */
+  rxJitBranch(vm, "\xe9", 1, vm->jit_exit);
+
+  /* Continue after the address in eax, as after a return */
+  vm->jit_dispatch = vm->jit_used;
+  EMIT("\x8d\x48\x01");                      /* lea ecx, [rax+1]   */
+  EMIT("\x48\x8b\x55"); FIELD(entry);        /* mov rdx, [rbp+entry] */
+  EMIT("\x48\x8b\x14\xca");                  /* mov rdx, [rdx+rcx*8] */
+  EMIT("\x48\x85\xd2\x74\x02\xff\xe2");      /* test rdx, rdx; jz; jmp rdx */
+  EMIT("\x89\x45");     FIELD(scratch);      /* mov [rbp+scratch], eax */
+  EMIT("\x48\x8b\x7d"); FIELD(vm);           /* mov rdi, [rbp+vm]  */
+  EMIT("\x89\xce");                          /* mov esi, ecx       */
+  EMIT("\xff\x55");     FIELD(lookup);       /* call [rbp+lookup]  */
+  EMIT("\x48\x85\xc0\x74\x02\xff\xe0");      /* test rax, rax; jz; jmp rax */
+  EMIT("\x8b\x45");     FIELD(scratch);      /* mov eax, [rbp+scratch] */
+  rxJitBranch(vm, "\xe9", 1, vm->jit_exit);
+
+  /* Return to the address in eax, through a frame if it matches */
+  vm->jit_return = vm->jit_used;
+  EMIT("\x49\x8d\x4d\x04");                  /* lea rcx, [r13+4]   */
+  EMIT("\x48\x2b\x4d"); FIELD(address);      /* sub rcx, [rbp+address] */
+  EMIT("\x48\xc1\xe1\x20\x48\x09\xc1");      /* shl rcx, 32; or rcx, rax */
+  again = vm->jit_used;
+  EMIT("\x48\x3b\x4c\x24\x08\x75\x03");      /* cmp rcx, [rsp+8]; jne */
+  EMIT("\xc2\x08\x00");                      /* ret 8              */
+  EMIT("\x48\x8b\x54\x24\x08");              /* mov rdx, [rsp+8]   */
+  EMIT("\x48\xc1\xfa\x20");                  /* sar rdx, 32        */
+  EMIT("\x48\x89\xce\x48\xc1\xfe\x20");      /* mov rsi, rcx; sar rsi, 32 */
+  EMIT("\x39\xf2");                          /* cmp edx, esi       */
+  rxJitBranch(vm, "\x0f\x8c", 2, vm->jit_dispatch);
+  EMIT("\x48\x83\xc4\x10");                  /* add rsp, 16        */
+  rxJitBranch(vm, "\xe9", 1, again);
+
+  vm->jit_base = vm->jit_used;
+  vm->jit_lo = MAX_IMAGE_SIZE;
+  vm->jit_hi = 0;
+  mprotect(vm->jit_code, JIT_BUFFER, PROT_READ | PROT_EXEC);
+  return 1;
+}
+
+/* Words starting with POP take their own return address, to skip the
+   data after the call (as quotes do) or to leave their caller. Calls
+   to them push no frame, as it could never be matched. */
+int rxJitTakesReturn(VM *vm, CELL a) {
+  if (vm->image[a] == VM_NOP && a + 1 < vm->image_size) a++;
+  if (vm->image[a] == VM_NOP && a + 1 < vm->image_size) a++;
+  return vm->image[a] == VM_POP;
+}
+
+/* Returns nonzero if the word at a is at most JIT_INLINE instructions,
+   without branches, followed by a RETURN */
+int rxJitInlinable(VM *vm, CELL a) {
+  int i, op;
+  for (i = 0; i <= JIT_INLINE && a < vm->image_size - 1; i++) {
+    op = rxOpClass(vm->image[a]);
+    if (op == VM_RETURN)
+      return 1;
+    if ((op >= VM_LOOP && op <= VM_EQ_JUMP) || op == VM_ZERO_EXIT ||
+        op == VM_IN || op == VM_OUT || op == VM_WAIT)
+      return 0;
+    a += rxOpLength(op);
+  }
+  return 0;
+}
+
+void rxJitInstruction(VM *vm, struct rxJitRegion *r, CELL p);
+
+/* Copy the word at a into the caller at p. The return address pushed
+   for the call is still popped and checked by the copied RETURN. The
+   word may lie outside the region, so jit_lo and jit_hi are widened to
+   take it in, for writes to it to be seen and its coverage cleared. */
+void rxJitInline(VM *vm, struct rxJitRegion *r, CELL p, CELL a) {
+  long cont[2], call, stub;
+
+  if (vm->jit_lo > a)
+    vm->jit_lo = a;
+  r->depth++;
+  for (; vm->image[a] != VM_RETURN; a += rxOpLength(vm->image[a])) {
+    vm->jit_covered[a] = vm->jit_covered[a + 1] = 1;
+    rxJitInstruction(vm, r, a);
+    r->inlined++;
+  }
+  vm->jit_covered[a] = 1;
+  if (vm->jit_hi < a + 1)
+    vm->jit_hi = a + 1;
+  r->depth--;
+
+  rxJitPopAddress(vm);
+  EMIT("\x3b\x45"); FIELD(size);            /* cmp eax, [rbp+size] */
+  rxJitBranch(vm, "\x0f\x83", 2, vm->jit_halt);
+  EMIT("\x3d"); rxJitCell(vm, p);            /* cmp eax, p         */
+  EMIT("\x0f\x84"); cont[0] = vm->jit_used; rxJitCell(vm, 0);
+
+  /* Returning elsewhere. If p is still on the address stack (as after
+     do) this is really a call, so push a frame for the return to p. */
+  EMIT("\x41\x81\x7d\x00"); rxJitCell(vm, p);  /* cmp [r13], p */
+  EMIT("\x0f\x85"); call = vm->jit_used; rxJitCell(vm, 0);
+  EMIT("\x48\x3b\x65"); FIELD(limit);      /* cmp rsp, [rbp+limit] */
+  EMIT("\x73\x04");                        /* jae, or drop frames: */
+  EMIT("\x48\x8b\x65"); FIELD(base);       /* mov rsp, [rbp+base] */
+  EMIT("\x48\x89\xc1");                    /* mov rcx, rax       */
+  EMIT("\x4c\x89\xe8");                    /* mov rax, r13       */
+  EMIT("\x48\x2b\x45"); FIELD(address);    /* sub rax, [rbp+address] */
+  EMIT("\x48\xc1\xe0\x20");                /* shl rax, 32        */
+  EMIT("\x48\x0d"); rxJitCell(vm, p);       /* or rax, p          */
+  EMIT("\x50");                            /* push rax           */
+  EMIT("\x48\x89\xc8");                    /* mov rax, rcx       */
+  EMIT("\xe8"); stub = vm->jit_used; rxJitCell(vm, 0);
+  EMIT("\xe9"); cont[1] = vm->jit_used; rxJitCell(vm, 0);
+
+  /* Continue after eax, through a jump made from here */
+  *(int32_t *)(vm->jit_code + call) = vm->jit_used - (call + 4);
+  *(int32_t *)(vm->jit_code + stub) = vm->jit_used - (stub + 4);
+  EMIT("\x8d\x48\x01");                    /* lea ecx, [rax+1]   */
+  EMIT("\x48\x8b\x55"); FIELD(entry);      /* mov rdx, [rbp+entry] */
+  EMIT("\x48\x8b\x14\xca");                /* mov rdx, [rdx+rcx*8] */
+  EMIT("\x48\x85\xd2");                    /* test rdx, rdx      */
+  rxJitBranch(vm, "\x0f\x84", 2, vm->jit_dispatch);
+  EMIT("\xff\xe2");                        /* jmp rdx            */
+
+  *(int32_t *)(vm->jit_code + cont[0]) = vm->jit_used - (cont[0] + 4);
+  *(int32_t *)(vm->jit_code + cont[1]) = vm->jit_used - (cont[1] + 4);
+}
+
+void rxJitCall(VM *vm, struct rxJitRegion *r, CELL p, CELL op) {
+  int frame;
+  long at = -1;
+
+  if (op - 1 < 0 || op - 1 >= vm->image_size) {
+    rxJitGoto(vm, r, "\xe9", 1, p, 1);
+    return;
+  }
+  EMIT("\x49\x83\xc5\x04");                  /* add r13, 4         */
+  EMIT("\x41\xc7\x45\x00"); rxJitCell(vm, p); /* mov [r13], p       */
+  if (r->depth < JIT_DEPTH && r->inlined < JIT_WINDOW &&
+      rxJitInlinable(vm, op)) {
+    rxJitInline(vm, r, p, op);
+    return;
+  }
+  frame = !rxJitTakesReturn(vm, op);
+  if (frame) {
+    EMIT("\x48\x3b\x65"); FIELD(limit);      /* cmp rsp, [rbp+limit] */
+    EMIT("\x73\x04");                        /* jae, or drop frames: */
+    EMIT("\x48\x8b\x65"); FIELD(base);       /* mov rsp, [rbp+base] */
+    EMIT("\x4c\x89\xe8");                    /* mov rax, r13       */
+    EMIT("\x48\x2b\x45"); FIELD(address);    /* sub rax, [rbp+address] */
+    EMIT("\x48\xc1\xe0\x20");                /* shl rax, 32        */
+    EMIT("\x48\x0d"); rxJitCell(vm, p);       /* or rax, p          */
+    EMIT("\x50");                            /* push rax           */
+  }
+  if (op >= r->start && op < r->end && r->reached[op - r->start]) {
+    rxJitGoto(vm, r, frame ? "\xe8" : "\xe9", 1, op, 0);
+    return;
+  }
+  if (frame) {
+    EMIT("\xe8\x05\x00\x00\x00");            /* call the lookup,   */
+    EMIT("\xe9"); at = vm->jit_used;          /* and skip it after  */
+    rxJitCell(vm, 0);
+  }
+  EMIT("\x48\x8b\x55"); FIELD(entry);        /* mov rdx, [rbp+entry] */
+  EMIT("\x48\x8b\x82");                      /* mov rax, [rdx+op*8] */
+  rxJitCell(vm, op * sizeof(void *));
+  EMIT("\x48\x85\xc0\x74\x02\xff\xe0");      /* test rax, rax; jz; jmp rax */
+  EMIT("\x48\x8b\x7d"); FIELD(vm);           /* mov rdi, [rbp+vm]  */
+  EMIT("\xbe"); rxJitCell(vm, op);            /* mov esi, op        */
+  EMIT("\xff\x55"); FIELD(lookup);           /* call [rbp+lookup]  */
+  EMIT("\x48\x85\xc0\x74\x02\xff\xe0");      /* test rax, rax; jz; jmp rax */
+  EMIT("\xb8"); rxJitCell(vm, op - 1);        /* mov eax, op - 1    */
+  rxJitBranch(vm, "\xe9", 1, vm->jit_exit);
+  if (at >= 0)
+    *(int32_t *)(vm->jit_code + at) = vm->jit_used - (at + 4);
+}
+
+void rxJitInstruction(VM *vm, struct rxJitRegion *r, CELL p) {
+  CELL op = vm->image[p], x = vm->image[p + 1];
+  switch (rxOpClass(op)) {
+    case VM_NOP:    break;
+    case VM_LIT:    rxJitDup(vm);
+                    EMIT("\xbb"); rxJitCell(vm, x);  /* mov ebx, x */
+                    break;
+    case VM_DUP:    rxJitDup(vm);
+                    break;
+    case VM_DROP:   rxJitDrop(vm);
+                    break;
+    case VM_SWAP:   EMIT("\x41\x8b\x44\x24\xfc");    /* mov eax, [r12-4] */
+                    EMIT("\x41\x89\x5c\x24\xfc");    /* mov [r12-4], ebx */
+                    EMIT("\x89\xc3");                /* mov ebx, eax */
+                    break;
+    case VM_PUSH:   EMIT("\x49\x83\xc5\x04");        /* add r13, 4 */
+                    EMIT("\x41\x89\x5d\x00");        /* mov [r13], ebx */
+                    rxJitDrop(vm);
+                    break;
+    case VM_POP:    rxJitDup(vm);
+                    EMIT("\x41\x8b\x5d\x00");        /* mov ebx, [r13] */
+                    EMIT("\x49\x83\xed\x04");        /* sub r13, 4 */
+                    break;
+    case VM_LOOP:   EMIT("\xff\xcb");                /* dec ebx */
+                    rxJitGoto(vm, r, "\x0f\x8f", 2, x, 0);
+                    rxJitDrop(vm);
+                    break;
+    case VM_JUMP:   rxJitGoto(vm, r, "\xe9", 1, x, 0);
+                    break;
+    case VM_RETURN: rxJitPopAddress(vm);
+                    EMIT("\x3b\x45"); FIELD(size); /* cmp eax, [rbp+size] */
+                    rxJitBranch(vm, "\x0f\x83", 2, vm->jit_halt);
+                    rxJitBranch(vm, "\xe9", 1, vm->jit_return);
+                    break;
+    case VM_GT_JUMP: case VM_LT_JUMP: case VM_NE_JUMP: case VM_EQ_JUMP:
+                    EMIT("\x89\xd8");                /* mov eax, ebx */
+                    EMIT("\x41\x8b\x4c\x24\xfc");    /* mov ecx, [r12-4] */
+                    rxJitDrop(vm);
+                    rxJitDrop(vm);
+                    EMIT("\x39\xc1");                /* cmp ecx, eax */
+                    if (op == VM_GT_JUMP) rxJitGoto(vm, r, "\x0f\x8f", 2, x, 0);
+                    if (op == VM_LT_JUMP) rxJitGoto(vm, r, "\x0f\x8c", 2, x, 0);
+                    if (op == VM_NE_JUMP) rxJitGoto(vm, r, "\x0f\x85", 2, x, 0);
+                    if (op == VM_EQ_JUMP) rxJitGoto(vm, r, "\x0f\x84", 2, x, 0);
+                    break;
+    case VM_FETCH:  EMIT("\x3b\x5d"); FIELD(size); /* cmp ebx, [rbp+size] */
+                    rxJitGoto(vm, r, "\x0f\x83", 2, p, 1);
+                    EMIT("\x41\x8b\x1c\x9e");        /* mov ebx, [r14+rbx*4] */
+                    break;
+    case VM_STORE:  EMIT("\x3b\x5d"); FIELD(size); /* cmp ebx, [rbp+size] */
+                    rxJitGoto(vm, r, "\x0f\x83", 2, p, 1);
+                    EMIT("\x48\x8b\x7d"); FIELD(vm); /* mov rdi, [rbp+vm] */
+                    EMIT("\x89\xde");                /* mov esi, ebx */
+                    EMIT("\x41\x8b\x54\x24\xfc");    /* mov edx, [r12-4] */
+                    EMIT("\xff\x55"); FIELD(store);  /* call [rbp+store] */
+                    rxJitDrop(vm);
+                    rxJitDrop(vm);
+                    EMIT("\x85\xc0");                /* test eax, eax */
+                    rxJitGoto(vm, r, "\x0f\x85", 2, p + 1, 1);
+                    break;
+    case VM_ADD:    EMIT("\x89\xd8"); rxJitDrop(vm); EMIT("\x01\xc3");
+                    break;
+    case VM_SUB:    EMIT("\x89\xd8"); rxJitDrop(vm); EMIT("\x29\xc3");
+                    break;
+    case VM_MUL:    EMIT("\x89\xd8"); rxJitDrop(vm); EMIT("\x0f\xaf\xd8");
+                    break;
+    case VM_DIVMOD: EMIT("\x89\xd9");                /* mov ecx, ebx */
+                    EMIT("\x41\x8b\x44\x24\xfc");    /* mov eax, [r12-4] */
+                    EMIT("\x99\xf7\xf9");            /* cdq; idiv ecx */
+                    EMIT("\x89\xc3");                /* mov ebx, eax */
+                    EMIT("\x41\x89\x54\x24\xfc");    /* mov [r12-4], edx */
+                    break;
+    case VM_AND:    EMIT("\x89\xd8"); rxJitDrop(vm); EMIT("\x21\xc3");
+                    break;
+    case VM_OR:     EMIT("\x89\xd8"); rxJitDrop(vm); EMIT("\x09\xc3");
+                    break;
+    case VM_XOR:    EMIT("\x89\xd8"); rxJitDrop(vm); EMIT("\x31\xc3");
+                    break;
+    case VM_SHL:    EMIT("\x89\xd9"); rxJitDrop(vm); EMIT("\xd3\xe3");
+                    break;
+    case VM_SHR:    EMIT("\x89\xd9"); rxJitDrop(vm); EMIT("\xd3\xfb");
+                    break;
+    case VM_ZERO_EXIT:
+                    EMIT("\x85\xdb");                /* test ebx, ebx */
+                    rxJitGoto(vm, r, "\x0f\x85", 2, p + 1, 0);
+                    rxJitDrop(vm);
+                    rxJitPopAddress(vm);
+                    EMIT("\x8d\x48\x01");            /* lea ecx, [rax+1] */
+                    EMIT("\x3b\x4d"); FIELD(size); /* cmp ecx, [rbp+size] */
+                    rxJitBranch(vm, "\x0f\x87", 2, vm->jit_halt);
+                    rxJitBranch(vm, "\xe9", 1, vm->jit_return);
+                    break;
+    case VM_INC:    EMIT("\xff\xc3");
+                    break;
+    case VM_DEC:    EMIT("\xff\xcb");
+                    break;
+    case VM_CALL:   rxJitCall(vm, r, p, op);
+                    break;
+    default:        /* IN, OUT and WAIT are left to the interpreter */
+                    rxJitGoto(vm, r, "\xe9", 1, p, 1);
+  }
+}
+
+/* Instructions which never continue with the next one */
+int rxJitEndsFlow(CELL op) {
+  return op == VM_JUMP || op == VM_RETURN || op == VM_IN ||
+         op == VM_OUT || op == VM_WAIT;
+}
+
+void *rxJitCompile(VM *vm, CELL start) {
+  static struct rxJitRegion r;
+  static CELL work[JIT_WINDOW];
+  CELL p, q, op, len, add[2];
+  int i, n;
+  long to;
+
+  r.start = start;
+  r.end = (start + JIT_WINDOW < vm->image_size) ? start + JIT_WINDOW
+                                                 : vm->image_size;
+  r.fixups = 0;
+  r.depth = r.inlined = 0;
+  memset(r.reached, 0, JIT_WINDOW);
+
+  /* Find the instructions reachable from start */
+  r.reached[0] = 1;
+  work[0] = start;
+  for (n = 1; n > 0; ) {
+    p = work[--n];
+    op = vm->image[p];
+    len = rxOpLength(op);
+    if (p + len > r.end)
+      continue;
+    add[0] = rxJitEndsFlow(op) ? -1 : p + len;
+    add[1] = (len == 2 && op != VM_LIT) ? vm->image[p + 1] : -1;
+    if (rxOpClass(op) == VM_CALL)
+      add[1] = op;
+    for (i = 0; i < 2; i++)
+      if (add[i] >= start && add[i] < r.end && !r.reached[add[i] - start]) {
+        r.reached[add[i] - start] = 1;
+        work[n++] = add[i];
+      }
+  }
+
+  mprotect(vm->jit_code, JIT_BUFFER, PROT_READ | PROT_WRITE);
+  for (p = start; p < r.end; p++) {
+    if (!r.reached[p - start])
+      continue;
+    r.label[p - start] = vm->jit_used;
+    op = vm->image[p];
+    len = rxOpLength(op);
+    vm->jit_covered[p] = 1;
+    if (p + len > r.end) {
+      rxJitGoto(vm, &r, "\xe9", 1, p, 1);
+      continue;
+    }
+    if (len == 2)
+      vm->jit_covered[p + 1] = 1;
+    rxJitInstruction(vm, &r, p);
+    if (rxJitEndsFlow(op))
+      continue;
+    for (q = p + 1; q < r.end && !r.reached[q - start]; q++)
+      ;
+    if (q != p + len || q == r.end)
+      rxJitGoto(vm, &r, "\xe9", 1, p + len, 0);
+  }
+
+  /* Resolve the branches. Those leaving the region go through the
+     dispatch, or straight back to the interpreter if exit is set. */
+  for (i = 0; i < r.fixups; i++) {
+    p = r.fixup[i].ip;
+    if (!r.fixup[i].exit && p >= start && p < r.end && r.reached[p - start])
+      to = r.label[p - start];
+    else {
+      to = vm->jit_used;
+      EMIT("\xb8"); rxJitCell(vm, p - 1);      /* mov eax, p - 1 */
+      if (r.fixup[i].exit || p < 0 || p >= vm->image_size)
+        rxJitBranch(vm, "\xe9", 1, vm->jit_exit);
+      else
+        rxJitBranch(vm, "\xe9", 1, vm->jit_dispatch);
+    }
+    *(int32_t *)(vm->jit_code + r.fixup[i].at) = to - (r.fixup[i].at + 4);
+  }
+  mprotect(vm->jit_code, JIT_BUFFER, PROT_READ | PROT_EXEC);
+
+  for (p = start; p < r.end; p++)
+    if (r.reached[p - start])
+      vm->jit_entry[p] = vm->jit_code + r.label[p - start];
+  if (vm->jit_lo > start)
+    vm->jit_lo = start;
+  if (vm->jit_hi < r.end)
+    vm->jit_hi = r.end;
+  return vm->jit_entry[start];
+}
+
+/* Returns the native code for address a, compiling it once it has been
+   asked for often enough, or 0 to leave it to the interpreter */
+void *rxJitLookup(VM *vm, CELL a) {
+  if (a < 0 || a >= vm->image_size)
+    return 0;
+  if (vm->jit_entry[a] != 0)
+    return vm->jit_entry[a];
+  if (++vm->jit_hits[a] < JIT_THRESHOLD)
+    return 0;
+  vm->jit_hits[a] = 0;
+  if (!vm->jit_active &&
+      (vm->jit_stale || vm->jit_used + JIT_REGION > JIT_BUFFER)) {
+    rxJitFlush(vm);
+    vm->jit_used = vm->jit_base;
+    vm->jit_stale = 0;
+  }
+  if (vm->jit_used + JIT_REGION > JIT_BUFFER)
+    return 0;
+  return rxJitCompile(vm, a);
+}
+
+/* Run native code from the threaded engine, with the VM state spilled */
+void rxJitRun(VM *vm, void *code) {
+  CELL (*enter)(void *, struct rxJitState *);
+  struct rxJitState s;
+
+  s.tos = vm->data[vm->sp];
+  s.size = vm->image_size;
+  s.sp = vm->data + vm->sp;
+  s.rsp = vm->address + vm->rsp;
+  s.image = vm->image;
+  s.data = vm->data;
+  s.address = vm->address;
+  s.entry = vm->jit_entry;
+  s.vm = vm;
+  s.lookup = rxJitLookup;
+  s.store = rxJitStore;
+
+  enter = (CELL (*)(void *, struct rxJitState *))vm->jit_code;
+  vm->jit_active = 1;
+  vm->ip = enter(code, &s);
+  vm->jit_active = 0;
+  vm->sp = s.sp - vm->data;
+  vm->rsp = s.rsp - vm->address;
+  vm->data[vm->sp] = s.tos;
+}
+#undef FIELD
+#undef EMIT
+#endif
+
+/* Translated Code ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   tools/translate.c turns the code in an image into a C function,
+   rxAotRun(), which runs from vm->ip + 1 until it reaches code it does
+   not have, and then returns to the threaded engine. The engine enters
+   it again on calls and returns to any address in rxAotEntries[].
+
+   The translation is only used if the cells it was made from
+   (rxAotCovered[], holding rxAotCells[]) are the same in the loaded
+   image. The tables are lists of start and count pairs, ending with a
+   zero count.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+#ifdef RXAOT
+int rxAotPrepare(VM *vm) {
+  const CELL *r, *c = rxAotCells;
+  CELL i;
+
+  for (r = rxAotCovered; r[1] != 0; r += 2)
+    for (i = r[0]; i < r[0] + r[1]; i++)
+      if (i >= vm->image_size || vm->image[i] != *c++)
+        return 0;
+  for (r = rxAotCovered; r[1] != 0; r += 2) {
+    memset(vm->aot_covered + r[0], 1, r[1]);
+    if (vm->aot_hi < r[0] + r[1])
+      vm->aot_hi = r[0] + r[1];
+  }
+  for (r = rxAotEntries; r[1] != 0; r += 2)
+    memset(vm->aot_entry + r[0], 1, r[1]);
+  return 1;
+}
+#endif
+
+/* Threaded Engine ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   This runs the same instruction set as rxProcessOpcode(), but each
+   handler jumps directly to the next one instead of returning to a
+   loop and going through the switch. It does not track statistics;
+   --stats uses the reference engine.
+
+   Handlers are found through vm->shadow[], with op_resolve decoding
+   any address not seen before. Calls and jumps go straight to the
+   destination kept in vm->target[].
+
+   IP, the stack pointers and the top of the data stack are kept in
+   locals for the whole run. The rest of the data stack stays in
+   vm->data[], so data[SP] is stale until SPILL writes TOS back. This
+   is done before any device is run, so the handlers (and the -5/-6
+   depth queries) see the same VM state as with the reference engine.
+   vm->shadow and vm->target are kept in locals as well, and loaded
+   again by FILL and after stores past the end of the image, either of
+   which may have grown (and so moved) them.
+
+   Calls check vm->hooks, going to call_hook to take a sample for
+   --profile or, with --jit, to look for native code for their
+   destination at jit_call, and run it if there is any. Builds with
+   translated code do the same at aot_enter, for calls and returns.
+
+   Port 3 is only ever observed through IN, so it is set after the
+   instructions touching ports instead of after every instruction.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+#ifdef RXTHREADED
+#undef IP
+#undef SP
+#undef RSP
+#undef TOS
+#undef NOS
+#undef TORS
+#undef DROP
+#define IP   ip
+#define SP   sp
+#define RSP  rsp
+#define TOS  tos
+#define NOS  data[SP-1]
+#define TORS address[RSP]
+#define DUP  { SP++; NOS = TOS; }
+#define DROP { if (--SP < 0) { SP = 0; goto done; } TOS = data[SP]; }
+#define SPILL { vm->ip = IP; vm->sp = SP; vm->rsp = RSP; data[SP] = TOS; }
+#define TABLES { shadow = vm->shadow; target = vm->target; }
+#define FILL  { IP = vm->ip; SP = vm->sp; RSP = vm->rsp; TOS = data[SP]; \
+                TABLES }
+#define NEXT     goto *((char *)&&op_resolve + shadow[++IP]);
+#define INSIDE(a) ((uint64_t)(a) < (uint64_t)vm->image_size)
+#define JUMPTO(x) { IP = (x); \
+                    if ((uint64_t)IP + 1 > (uint64_t)vm->image_size) goto done; }
+#define SKIPNOPS { if (vm->image[IP+1] == 0) IP++; \
+                   if (vm->image[IP+1] == 0) IP++; }
+
+/* Each body leaves IP on the last cell of its instruction, so they can
+   be strung together (with an IP++ between them) into fused handlers.
+   DO_FETCH masks instead of branching, reading cell 0 as 0 for an
+   address outside the image; a branch there costs more than it saves,
+   as it stops gcc from keeping a separate dispatch for every handler. */
+#define DO_NOP
+#define DO_LIT       DUP IP++; TOS = vm->image[IP];
+#define DO_DUP       DUP
+#define DO_DROP      DROP
+#define DO_SWAP      a = TOS; TOS = NOS; NOS = a;
+#define DO_PUSH      RSP++; TORS = TOS; DROP
+#define DO_POP       DUP TOS = TORS; RSP--;
+#define DO_LOOP      TOS--; IP++; \
+                     if (TOS != 0 && TOS > -1) JUMPTO(vm->image[IP] - 1) \
+                     else DROP
+#define DO_JUMP      IP = target[IP];
+#define DO_RETURN    IP = TORS; RSP--; \
+                     if (!INSIDE(IP)) goto done; \
+                     SKIPNOPS AOT_ENTER
+#define DO_GT_JUMP   IP++; if (NOS > TOS) JUMPTO(vm->image[IP] - 1) DROP DROP
+#define DO_LT_JUMP   IP++; if (NOS < TOS) JUMPTO(vm->image[IP] - 1) DROP DROP
+#define DO_NE_JUMP   IP++; if (TOS != NOS) JUMPTO(vm->image[IP] - 1) DROP DROP
+#define DO_EQ_JUMP   IP++; if (TOS == NOS) JUMPTO(vm->image[IP] - 1) DROP DROP
+#define DO_FETCH     a = -(CELL)INSIDE(TOS); TOS = vm->image[TOS & a] & a;
+#define DO_STORE     if ((uint64_t)TOS < (uint64_t)vm->store_limit) { \
+                       rxInvalidate(vm, TOS, NOS); vm->image[TOS] = NOS; } \
+                     else { rxStoreOutside(vm, TOS, NOS); TABLES } \
+                     DROP DROP
+#define DO_ADD       a = TOS; DROP TOS += a;
+#define DO_SUB       a = TOS; DROP TOS -= a;
+#define DO_MUL       a = TOS; DROP TOS *= a;
+#define DO_DIVMOD    a = TOS; b = NOS; TOS = b / a; NOS = b % a;
+#define DO_AND       a = TOS; b = NOS; DROP TOS = a & b;
+#define DO_OR        a = TOS; b = NOS; DROP TOS = a | b;
+#define DO_XOR       a = TOS; b = NOS; DROP TOS = a ^ b;
+#define DO_SHL       a = TOS; b = NOS; DROP TOS = b << a;
+#define DO_SHR       a = TOS; DROP TOS >>= a;
+#define DO_ZERO_EXIT if (TOS == 0) { DROP JUMPTO(TORS) RSP--; }
+#define DO_INC       TOS += 1;
+#define DO_DEC       TOS -= 1;
+#define DO_IN        a = TOS; TOS = 0; \
+                     if ((uint64_t)a < (uint64_t)vm->port_count) { \
+                       TOS = vm->ports[a]; vm->ports[a] = 0; } \
+                     vm->ports[3] = 1;
+#define DO_OUT       a = TOS; \
+                     if ((uint64_t)a < (uint64_t)vm->port_count) { \
+                       vm->ports[0] = 0; vm->ports[a] = NOS; \
+                       vm->dirty[a / PORT_BITS] |= 1UL << (a % PORT_BITS); } \
+                     else rxPortOut(vm, a, NOS); \
+                     vm->ports[3] = 1; DROP DROP
+#define DO_WAIT      SPILL rxDeviceHandler(vm); FILL JUMPTO(IP) \
+                     vm->ports[3] = 1;
+#define DO_CALL      RSP++; TORS = IP; IP = target[IP]; CALL_HOOK \
+                     AOT_ENTER
+#define DO_TAIL_CALL IP = target[IP]; AOT_ENTER
+
+#define CALL_HOOK    if (vm->hooks) goto call_hook;
+
+#ifdef RXAOT
+#define AOT_ENTER    if (vm->aot && vm->aot_entry[IP + 1]) goto aot_enter;
+#else
+#define AOT_ENTER
+#endif
+
+void rxThreadedEngine(VM *vm) {
+  static void *ops[NUM_OPS + 1] = {
+    &&op_nop,    &&op_lit,    &&op_dup,    &&op_drop,   &&op_swap,
+    &&op_push,   &&op_pop,    &&op_loop,   &&op_jump,   &&op_return,
+    &&op_gt_jump, &&op_lt_jump, &&op_ne_jump, &&op_eq_jump,
+    &&op_fetch,  &&op_store,  &&op_add,    &&op_sub,    &&op_mul,
+    &&op_divmod, &&op_and,    &&op_or,     &&op_xor,    &&op_shl,
+    &&op_shr,    &&op_zero_exit, &&op_inc, &&op_dec,    &&op_in,
+    &&op_out,    &&op_wait,   &&op_call };
+  static void *fused[FUSED_COUNT + 1] = { FUSED_LABELS 0 };
+  CELL a, b, ip, sp, rsp, tos;
+  CELL *data = vm->data, *address = vm->address, *target;
+  int32_t *shadow;
+  void *handler;
+  int i;
+
+  FILL
+  IP--;
+  vm->ports[3] = 1;
+  AOT_ENTER
+  NEXT
+
+  op_resolve:
+       if (IP < 0 || IP >= vm->image_size)
+         goto done;
+       a = vm->image[IP];
+       handler = ops[rxOpClass(a)];
+       if (a == VM_JUMP)
+         vm->target[IP] = rxSkipNops(vm, vm->image[IP+1] - 1);
+       if (rxOpClass(a) == VM_CALL) {
+         vm->target[IP] = rxSkipNops(vm, a - 1);
+         if (vm->image[IP+1] == VM_RETURN && rxTailSafe(vm, a))
+           handler = &&op_tail_call;
+       }
+       for (i = 0; i < FUSED_COUNT; i++)
+         if ((b = rxMatchFused(vm, IP, rxFusedPatterns[i])) != 0) {
+           handler = fused[i];
+           if (vm->image[b] == VM_JUMP)
+             vm->target[b] = rxSkipNops(vm, vm->image[b+1] - 1);
+           if (rxOpClass(vm->image[b]) == VM_CALL)
+             vm->target[b] = rxSkipNops(vm, vm->image[b] - 1);
+           break;
+         }
+       vm->shadow[IP] = (char *)handler - (char *)&&op_resolve;
+       if (vm->decoded < IP + FUSED_SPAN)
+         vm->decoded = (IP + FUSED_SPAN < vm->image_size) ? IP + FUSED_SPAN
+                                                          : vm->image_size;
+       goto *handler;
+
+  op_nop:       DO_NOP       NEXT
+  op_lit:       DO_LIT       NEXT
+  op_dup:       DO_DUP       NEXT
+  op_drop:      DO_DROP      NEXT
+  op_swap:      DO_SWAP      NEXT
+  op_push:      DO_PUSH      NEXT
+  op_pop:       DO_POP       NEXT
+  op_loop:      DO_LOOP      NEXT
+  op_jump:      DO_JUMP      NEXT
+  op_return:    DO_RETURN    NEXT
+  op_gt_jump:   DO_GT_JUMP   NEXT
+  op_lt_jump:   DO_LT_JUMP   NEXT
+  op_ne_jump:   DO_NE_JUMP   NEXT
+  op_eq_jump:   DO_EQ_JUMP   NEXT
+  op_fetch:     DO_FETCH     NEXT
+  op_store:     DO_STORE     NEXT
+  op_add:       DO_ADD       NEXT
+  op_sub:       DO_SUB       NEXT
+  op_mul:       DO_MUL       NEXT
+  op_divmod:    DO_DIVMOD    NEXT
+  op_and:       DO_AND       NEXT
+  op_or:        DO_OR        NEXT
+  op_xor:       DO_XOR       NEXT
+  op_shl:       DO_SHL       NEXT
+  op_shr:       DO_SHR       NEXT
+  op_zero_exit: DO_ZERO_EXIT NEXT
+  op_inc:       DO_INC       NEXT
+  op_dec:       DO_DEC       NEXT
+  op_in:        DO_IN        NEXT
+  op_out:       DO_OUT       NEXT
+  op_wait:      DO_WAIT      NEXT
+  op_call:      DO_CALL      NEXT
+  op_tail_call: DO_TAIL_CALL NEXT
+
+  FUSED_HANDLERS
+
+  call_hook:
+    if (vm->hooks & HOOK_SAMPLE)
+      rxSample(vm, IP + 1, RSP);
+#ifdef RXJIT
+    if (vm->hooks & HOOK_JIT)
+      goto jit_call;
+#endif
+    AOT_ENTER
+    NEXT
+
+#ifdef RXJIT
+  jit_call:
+    if ((handler = rxJitLookup(vm, vm->image[TORS])) == 0)
+      NEXT
+    SPILL
+    rxJitRun(vm, handler);
+    FILL
+    JUMPTO(IP)
+    NEXT
+#endif
+
+#ifdef RXAOT
+  aot_enter:
+    SPILL
+    rxAotRun(vm);
+    FILL
+    JUMPTO(IP)
+    NEXT
+#endif
+
+  done:
+    IP = MAX_IMAGE_SIZE;
+    SPILL
+}
+#undef AOT_ENTER
+#undef CALL_HOOK
+#undef INSIDE
+#undef SKIPNOPS
+#undef JUMPTO
+#undef NEXT
+#undef FILL
+#undef TABLES
+#undef SPILL
+#undef DROP
+#undef DUP
+#undef TORS
+#undef NOS
+#undef TOS
+#undef RSP
+#undef SP
+#undef IP
+#define IP   vm->ip
+#define SP   vm->sp
+#define RSP  vm->rsp
+#define DROP { vm->data[SP] = 0; if (--SP < 0) { SP = 0; IP = MAX_IMAGE_SIZE; } }
+#define TOS  vm->data[SP]
+#define NOS  vm->data[SP-1]
+#define TORS vm->address[RSP]
+#endif
+
 /* Stats ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+#define STATS_TOP 16
+
+#if RXSTATS > 1
+/* The name of the word whose xt is a, found by following the
+   dictionary from last (image[2]). Each header is link, class, xt,
+   then the name. */
+const char *rxWordName(VM *vm, CELL a) {
+  CELL h = vm->image[2];
+  int i;
+
+  for (i = 0; h > 0 && h < vm->image_size - 3 && i < vm->image_size; i++) {
+    if (vm->image[h + 2] == a) {
+      rxGetString(vm, h + 3);
+      return vm->request;
+    }
+    h = vm->image[h];
+  }
+  return "?";
+}
+
+/* Keep the STATS_TOP largest counts seen, in descending order */
+void rxRank(uint64_t *count, CELL *which, uint64_t n, CELL w) {
+  int i;
+
+  if (n <= count[STATS_TOP - 1])
+    return;
+  for (i = STATS_TOP - 1; i > 0 && count[i - 1] < n; i--) {
+    count[i] = count[i - 1];
+    which[i] = which[i - 1];
+  }
+  count[i] = n;
+  which[i] = w;
+}
+
+void rxDisplayProfile(VM *vm)
+{
+  uint64_t count[STATS_TOP];
+  CELL which[STATS_TOP];
+  int x, y;
+
+  memset(count, 0, sizeof(count));
+  for (x = 0; x <= NUM_OPS; x++)
+    for (y = 0; y <= NUM_OPS; y++)
+      rxRank(count, which, vm->bigrams[x][y], x * (NUM_OPS + 1) + y);
+  printf("Most frequent pairs\n");
+  for (x = 0; x < STATS_TOP && count[x]; x++)
+    printf("%12llu %s %s\n", (unsigned long long)count[x],
+           rxOpNames[which[x] / (NUM_OPS + 1)],
+           rxOpNames[which[x] % (NUM_OPS + 1)]);
+
+  memset(count, 0, sizeof(count));
+  for (x = 0; x < vm->image_size; x++)
+    rxRank(count, which, vm->calls[x], x);
+  printf("Most called words\n");
+  for (x = 0; x < STATS_TOP && count[x]; x++)
+    printf("%12llu %s (%lld)\n", (unsigned long long)count[x],
+           rxWordName(vm, which[x]), (long long)which[x]);
+}
+#endif
+
 void rxDisplayStats(VM *vm)
 {
-  int s, i;
+#if RXSTATS > 0
+  int i;
 
   printf("Runtime Statistics\n");
-  printf("NOP:     %d\n", vm->stats[VM_NOP]);
-  printf("LIT:     %d\n", vm->stats[VM_LIT]);
-  printf("DUP:     %d\n", vm->stats[VM_DUP]);
-  printf("DROP:    %d\n", vm->stats[VM_DROP]);
-  printf("SWAP:    %d\n", vm->stats[VM_SWAP]);
-  printf("PUSH:    %d\n", vm->stats[VM_PUSH]);
-  printf("POP:     %d\n", vm->stats[VM_POP]);
-  printf("LOOP:    %d\n", vm->stats[VM_LOOP]);
-  printf("JUMP:    %d\n", vm->stats[VM_JUMP]);
-  printf("RETURN:  %d\n", vm->stats[VM_RETURN]);
-  printf(">JUMP:   %d\n", vm->stats[VM_GT_JUMP]);
-  printf("<JUMP:   %d\n", vm->stats[VM_LT_JUMP]);
-  printf("!JUMP:   %d\n", vm->stats[VM_NE_JUMP]);
-  printf("=JUMP:   %d\n", vm->stats[VM_EQ_JUMP]);
-  printf("FETCH:   %d\n", vm->stats[VM_FETCH]);
-  printf("STORE:   %d\n", vm->stats[VM_STORE]);
-  printf("ADD:     %d\n", vm->stats[VM_ADD]);
-  printf("SUB:     %d\n", vm->stats[VM_SUB]);
-  printf("MUL:     %d\n", vm->stats[VM_MUL]);
-  printf("DIVMOD:  %d\n", vm->stats[VM_DIVMOD]);
-  printf("AND:     %d\n", vm->stats[VM_AND]);
-  printf("OR:      %d\n", vm->stats[VM_OR]);
-  printf("XOR:     %d\n", vm->stats[VM_XOR]);
-  printf("SHL:     %d\n", vm->stats[VM_SHL]);
-  printf("SHR:     %d\n", vm->stats[VM_SHR]);
-  printf("0;:      %d\n", vm->stats[VM_ZERO_EXIT]);
-  printf("INC:     %d\n", vm->stats[VM_INC]);
-  printf("DEC:     %d\n", vm->stats[VM_DEC]);
-  printf("IN:      %d\n", vm->stats[VM_IN]);
-  printf("OUT:     %d\n", vm->stats[VM_OUT]);
-  printf("WAIT:    %d\n", vm->stats[VM_WAIT]);
-  printf("CALL:    %d\n", vm->stats[NUM_OPS]);
-  printf("Max SP:  %d\n", vm->max_sp);
-  printf("Max RSP: %d\n", vm->max_rsp);
-
-  for (s = i = 0; s < NUM_OPS; s++)
-    i += vm->stats[s];
-  printf("Total opcodes processed: %d\n", i);
+  for (i = 0; i <= NUM_OPS; i++)
+    printf("%s:%*s%llu\n", rxOpNames[i], (int)(8 - strlen(rxOpNames[i])), "",
+           (unsigned long long)vm->stats[i]);
+  printf("Max SP:  %llu\n", (unsigned long long)vm->max_sp);
+  printf("Max RSP: %llu\n", (unsigned long long)vm->max_rsp);
+  printf("Total opcodes processed: %llu\n",
+         (unsigned long long)rxCounter(vm, STAT_TOTAL));
+#endif
+#if RXSTATS > 1
+  if (vm->level >= STATS_FULL)
+    rxDisplayProfile(vm);
+#endif
 }
 
 /* Main ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
 int main(int argc, char **argv) {
   VM *vm;
-  int i, wantsStats;
+  int i, wantsStats, wantsSwitch, wantsHuge;
+#if RXSTATS > 1
+  char *ngrams = NULL;
+#endif
 
   /* ATH */
   char *env;
   struct stat sts;
 
-  wantsStats = 0;
-  vm = calloc(sizeof(VM), sizeof(char));
+  wantsStats = wantsSwitch = wantsHuge = 0;
+  vm = rxAllocVM();
+  rxInitDevices(vm);
   strcpy(vm->filename, LOCAL_FNAME);
 
   rxPrepareInput(vm);
@@ -694,14 +3867,53 @@ int main(int argc, char **argv) {
       strcpy(vm->filename, argv[++i]);
     if (strcmp(argv[i], "--shrink") == 0)
       vm->shrink = 1;
-    if (strcmp(argv[i], "--stats") == 0)
-      wantsStats = 1;
+    if (strcmp(argv[i], "--ram") == 0)
+      rxGrowImage(vm, strtol(argv[++i], 0, 10));
+    if (strcmp(argv[i], "--huge") == 0)
+      wantsHuge = 1;
+#if RXSTATS > 0
+    if (strcmp(argv[i], "--stats") == 0 && vm->level < STATS_COUNTS)
+      vm->level = wantsStats = STATS_COUNTS;
+#endif
+#if RXSTATS > 1
+    if (strcmp(argv[i], "--stats-full") == 0)
+      vm->level = wantsStats = STATS_FULL;
+#endif
+    if (strcmp(argv[i], "--switch") == 0)
+      wantsSwitch = 1;
+    if (strcmp(argv[i], "--profile") == 0)
+      vm->profile = argv[++i];
+#ifdef RXJIT
+    if (strcmp(argv[i], "--jit") == 0)
+      vm->jit = 1;
+#endif
+#if RXSTATS > 1
+    if (strcmp(argv[i], "--ngrams") == 0) {
+      ngrams = argv[++i];
+      vm->level = STATS_FULL;
+    }
+#endif
     if (strcmp(argv[i], "--help") == 0)
     {
       printf("--with filename    Add filename to the input stack\n");
       printf("--image filename   Use filename as the image to load\n");
       printf("--shrink           When saving, don't save unused cells\n");
+      printf("--ram cells        Start with room for at least cells cells\n");
+      printf("--huge             Use huge pages for the image\n");
+#if RXSTATS > 0
       printf("--stats            Display opcode usage and stack summaries upon exit\n");
+#endif
+#if RXSTATS > 1
+      printf("--stats-full       As --stats, adding the most frequent opcode pairs and words\n");
+#endif
+      printf("--switch           Use the reference switch engine\n");
+      printf("--profile filename Save sampled word call stacks to filename\n");
+#ifdef RXJIT
+      printf("--jit              Compile frequently called code to x86-64\n");
+#endif
+#if RXSTATS > 1
+      printf("--ngrams filename  Save counts of opcode pairs and triples to filename\n");
+#endif
       printf("--help             Display this text\n");
       exit(1);
     }
@@ -723,24 +3935,62 @@ int main(int argc, char **argv) {
         fprintf(stderr,"No image file and environment variable RETROIMAGE not set.\n");
         exit(1);
       } else {
-          strncpy(vm->filename, env,sizeof(vm->filename));
+          strncpy(vm->filename, env, sizeof(vm->filename) - 1);
           fprintf(stderr,"Loading image from %s\n", env);
       }
   }
+  if (wantsHuge)
+    rxHugeImage(vm);
   if (rxLoadImage(vm, vm->filename) == 0) {
     printf("Sorry, unable to find %s\n", vm->filename);
-    free(vm);
+    rxFreeVM(vm);
     exit(1);
   }
 
+#ifdef RXJIT
+  if (vm->jit && vm->profile == NULL && (vm->jit = rxJitInit(vm)) != 0)
+    vm->hooks |= HOOK_JIT;
+#endif
+
+#ifdef RXAOT
+  if ((vm->aot = rxAotPrepare(vm)) == 0)
+    fprintf(stderr, "%s does not match the translated code\n", vm->filename);
+#endif
+
+  if (vm->profile != NULL) {
+#ifdef RXAOT
+    vm->aot = 0;
+#endif
+    if (rxStartProfile(vm) == 0) {
+      fprintf(stderr, "Unable to start the profiler\n");
+      vm->profile = NULL;
+    }
+  }
+
   rxPrepareOutput(vm);
-  for (IP = 0; IP < IMAGE_SIZE; IP++)
-    rxProcessOpcode(vm);
+#ifdef RXTHREADED
+  if (vm->level == STATS_OFF && wantsSwitch == 0)
+    rxThreadedEngine(vm);
+  else
+#endif
+  if (vm->level == STATS_OFF && vm->profile == NULL)
+    for (IP = 0; IP < vm->image_size; IP++)
+      rxProcessOpcode(vm);
+  else
+    rxInstrumentedEngine(vm);
   rxRestoreIO(vm);
+  rxFinishSave(vm, 1);
 
-  if (wantsStats == 1)
+  if (vm->profile != NULL)
+    rxSaveProfile(vm);
+
+  if (wantsStats)
     rxDisplayStats(vm);
+#if RXSTATS > 1
+  if (ngrams != NULL)
+    rxSaveNgrams(vm, ngrams);
+#endif
 
-  free(vm);
+  rxFreeVM(vm);
   return 0;
 }
@@ -0,0 +1,162 @@
+/* Ngaro VM ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   Copyright (c) 2008 - 2011, Charles Childers
+   Copyright (c) 2009 - 2010, Luke Parrish
+   Copyright (c) 2010,        Marc Simpson
+   Copyright (c) 2010,        Jay Skeer
+   Copyright (c) 2011,        Kenneth Keating
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+#include "ngaro.hpp"
+#include <sys/stat.h>
+#include <errno.h>
+
+/* Configuration ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   A driver for the engine in ngaro.hpp. The cell size and byte order
+   are taken from the image, so this runs retroImage, retroImage16,
+   retroImage64 and the big endian versions made by tools/convert.c.
+
+   Use -DRXCHECKED to build a VM that stops with a message on errors
+   in the image (stack overflows, bad addresses, etc) instead of
+   running on. --stats and --trace pick engines with those policies
+   on at runtime, leaving the default engine without them.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+using namespace ngaro;
+
+#ifdef RXCHECKED
+typedef Checked Checks;
+#else
+typedef Unchecked Checks;
+#endif
+
+bool readImage(const char *name, std::vector<unsigned char> &bytes) {
+  FILE *fp;
+  unsigned char buffer[65536];
+  size_t n;
+
+  if ((fp = fopen(name, "rb")) == NULL)
+    return false;
+  while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+    bytes.insert(bytes.end(), buffer, buffer + n);
+  fclose(fp);
+  return true;
+}
+
+/* Images start with a jump (8) to the main loop. Trying the widest
+   cells first, the first format in which the image starts with 8 gives
+   the cell size and byte order, as reading too wide would include part
+   of the jump's target. */
+template <typename Cell, typename Order>
+bool startsWithJump(const std::vector<unsigned char> &bytes) {
+  return bytes.size() >= 4 * sizeof(Cell) && bytes.size() % sizeof(Cell) == 0
+         && Order::template get<Cell>(&bytes[0]) == 8;
+}
+
+bool detect(const std::vector<unsigned char> &bytes, int &width, bool &big) {
+  big = false;
+  if (startsWithJump<int64_t, Little>(bytes) ||
+      (big = startsWithJump<int64_t, Big>(bytes)))
+    width = 8;
+  else if (startsWithJump<int32_t, Little>(bytes) ||
+           (big = startsWithJump<int32_t, Big>(bytes)))
+    width = 4;
+  else if (startsWithJump<int16_t, Little>(bytes) ||
+           (big = startsWithJump<int16_t, Big>(bytes)))
+    width = 2;
+  else
+    return false;
+  return true;
+}
+
+template <typename E>
+int start(Host &host, const std::vector<unsigned char> &bytes) {
+  E *vm = new E(host);
+
+  if (vm->load(bytes) == 0) {
+    printf("Sorry, unable to find %s\n", host.filename.c_str());
+    delete vm;
+    exit(1);
+  }
+  host.prepareOutput();
+  vm->run();
+  host.restoreIO();
+  vm->stats.report();
+  delete vm;
+  return 0;
+}
+
+template <typename Cell, typename Order>
+int select(Host &host, const std::vector<unsigned char> &bytes,
+           bool stats, bool trace) {
+  if (stats && trace)
+    return start<Engine<Cell, Order, Stats, Checks, Trace> >(host, bytes);
+  if (stats)
+    return start<Engine<Cell, Order, Stats, Checks, NoTrace> >(host, bytes);
+  if (trace)
+    return start<Engine<Cell, Order, NoStats, Checks, Trace> >(host, bytes);
+  return start<Engine<Cell, Order, NoStats, Checks, NoTrace> >(host, bytes);
+}
+
+template <typename Order>
+int select(Host &host, const std::vector<unsigned char> &bytes, int width,
+           bool stats, bool trace) {
+  switch (width) {
+    case 2:  return select<int16_t, Order>(host, bytes, stats, trace);
+    case 8:  return select<int64_t, Order>(host, bytes, stats, trace);
+    default: return select<int32_t, Order>(host, bytes, stats, trace);
+  }
+}
+
+/* Main ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+int main(int argc, char **argv) {
+  Host host;
+  std::vector<unsigned char> bytes;
+  std::vector<const char *> with;
+  bool stats = false, trace = false, big;
+  int i, width;
+  char *env;
+  struct stat sts;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--with") == 0 && i + 1 < argc)
+      with.push_back(argv[++i]);
+    else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc)
+      host.filename = argv[++i];
+    else if (strcmp(argv[i], "--shrink") == 0)
+      host.shrink = true;
+    else if (strcmp(argv[i], "--stats") == 0)
+      stats = true;
+    else if (strcmp(argv[i], "--trace") == 0)
+      trace = true;
+    else if (strcmp(argv[i], "--help") == 0) {
+      printf("--with filename    Add filename to the input stack\n");
+      printf("--image filename   Use filename as the image to load\n");
+      printf("--shrink           When saving, don't save unused cells\n");
+      printf("--stats            Display opcode usage and stack summaries upon exit\n");
+      printf("--trace            Log each instruction to stderr\n");
+      printf("--help             Display this text\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < (int)with.size(); i++)
+    host.include(with[i]);
+
+  if (stat(host.filename.c_str(), &sts) == -1 && errno == ENOENT) {
+    if ((env = getenv("RETROIMAGE")) == NULL) {
+      fprintf(stderr, "No image file and environment variable RETROIMAGE not set.\n");
+      exit(1);
+    }
+    host.filename = env;
+    fprintf(stderr, "Loading image from %s\n", env);
+  }
+  if (!readImage(host.filename.c_str(), bytes)) {
+    printf("Unable to find the retroImage!\n");
+    exit(1);
+  }
+  if (!detect(bytes, width, big)) {
+    fprintf(stderr, "%s is not a Retro image\n", host.filename.c_str());
+    exit(1);
+  }
+
+  if (big)
+    return select<Big>(host, bytes, width, stats, trace);
+  return select<Little>(host, bytes, width, stats, trace);
+}
@@ -17,6 +17,13 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <poll.h>
 
 /* Configuration ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
@@ -30,6 +37,11 @@
 
    If memory is tight, cut the MAX_FILE_NAME and MAX_REQUEST_LENGTH.
 
+   MAX_EVENTS is how many ready sockets are collected from the kernel
+   at a time, and SOCKET_BUFFER caps the bytes moved by one bulk send
+   or receive. Each connection buffers up to SOCKET_RING bytes of input
+   and of output; this must be a power of two.
+
    You can also cut the ADDRESSES stack size down, but if you have
    heavy nesting or recursion this may cause problems. If you do modify
    it and experience odd problems, try raising it a bit higher.
@@ -42,10 +54,13 @@
 #define IMAGE_SIZE      1000000
 #define ADDRESSES          1024
 #define STACK_DEPTH         128
-#define PORTS                12
+#define PORTS                14
 #define MAX_FILE_NAME      1024
 #define MAX_REQUEST_LENGTH 1024
 #define MAX_OPEN_FILES        8
+#define MAX_EVENTS           64
+#define SOCKET_BUFFER     65536
+#define SOCKET_RING        8192
 #define LOCAL                 "retroImage"
 
 #ifdef RX64
@@ -88,6 +103,11 @@ typedef struct {
   char filename[MAX_FILE_NAME];
   char request[MAX_REQUEST_LENGTH];
   struct termios new_termios, old_termios;
+  int poller, ready, next, connectionCount;
+  struct rxConnection *connections;
+  long socketCalls;
+  struct epoll_event events[MAX_EVENTS];
+  unsigned char buffer[SOCKET_BUFFER];
 } VM;
 
 /* Macros ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
@@ -297,6 +317,144 @@ void rxQueryEnvironment(VM *vm) {
     vm->image[dest] = 0;
 }
 
+/* Socket Buffers ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   Each connection gets a ring of SOCKET_RING bytes for input and one
+   for output, allocated when first used. Reads take bytes from the
+   input ring, refilling it with a single recv of as much as fits.
+   Writes add to the output ring, which is sent when it fills, when it
+   is flushed, or before the input ring of the same socket is refilled,
+   so a reply is never held back while waiting for the next request.
+
+     -7   s-c        read a byte, or 0 if the connection closed
+     -14  $s-n       add a string to the output ring, returning the
+                     number of bytes taken
+     -15  s-n        flush the output ring, returning 0 once it is sent,
+                     the bytes left if the socket is not ready, or -1
+     -16  ands-n     read up to and including the delimiter d into the
+                     n cells at a, as a string. Returns the length, 0
+                     if the connection closed, or -1 if the socket is
+                     not ready before the delimiter arrives; in that case
+                     nothing is taken. Lines longer than n-1 are split.
+     -17  $s-n       send the named file with sendfile(), returning the
+                     bytes sent or -1 if the file could not be opened
+
+   The bulk receive (-13) takes bytes from the input ring first, and the
+   other sends flush the output ring before sending.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+struct rxRing {
+  size_t head, tail;
+  unsigned char data[SOCKET_RING];
+};
+
+struct rxConnection {
+  struct rxRing *in, *out;
+};
+
+CELL rxSocketResult(ssize_t r)
+{
+  if (r >= 0)
+    return r;
+  return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? -1 : 0;
+}
+
+struct rxRing *rxSocketRing(VM *vm, int sock, int output)
+{
+  struct rxConnection *c;
+  struct rxRing **ring;
+  int n;
+
+  if (sock < 0)
+    return NULL;
+  if (sock >= vm->connectionCount) {
+    n = (sock + 1) * 2;
+    if ((c = realloc(vm->connections, n * sizeof(*c))) == NULL)
+      return NULL;
+    memset(c + vm->connectionCount, 0, (n - vm->connectionCount) * sizeof(*c));
+    vm->connections = c;
+    vm->connectionCount = n;
+  }
+  ring = output ? &vm->connections[sock].out : &vm->connections[sock].in;
+  if (*ring == NULL && (*ring = malloc(sizeof(struct rxRing))) != NULL)
+    (*ring)->head = (*ring)->tail = 0;
+  return *ring;
+}
+
+struct rxRing *rxPending(VM *vm, int sock)
+{
+  if (sock < 0 || sock >= vm->connectionCount)
+    return NULL;
+  return vm->connections[sock].out;
+}
+
+void rxFreeRings(VM *vm, int sock)
+{
+  if (sock < 0 || sock >= vm->connectionCount)
+    return;
+  free(vm->connections[sock].in);
+  free(vm->connections[sock].out);
+  vm->connections[sock].in = vm->connections[sock].out = NULL;
+}
+
+/* Describe n bytes of the ring starting at the count at, which may wrap
+   around the end of the data. */
+int rxRingSpans(struct rxRing *r, size_t at, size_t n, struct iovec *v)
+{
+  size_t start = at % SOCKET_RING;
+  v[0].iov_base = r->data + start;
+  v[0].iov_len = (n < SOCKET_RING - start) ? n : SOCKET_RING - start;
+  v[1].iov_base = r->data;
+  v[1].iov_len = n - v[0].iov_len;
+  return (v[1].iov_len > 0) ? 2 : 1;
+}
+
+/* Send what is waiting in the output ring. Returns 0 once it is all
+   sent, the bytes still waiting if the socket is not ready, or -1 if
+   the connection failed. */
+CELL rxFlush(VM *vm, int sock)
+{
+  struct rxRing *r = rxPending(vm, sock);
+  struct msghdr m;
+  struct iovec v[2];
+  ssize_t x;
+
+  if (r == NULL)
+    return 0;
+  memset(&m, 0, sizeof(m));
+  m.msg_iov = v;
+  while (r->tail != r->head) {
+    m.msg_iovlen = rxRingSpans(r, r->head, r->tail - r->head, v);
+    vm->socketCalls++;
+    if ((x = sendmsg(sock, &m, MSG_NOSIGNAL)) < 0)
+      return (rxSocketResult(x) == -1) ? (CELL)(r->tail - r->head) : -1;
+    r->head += x;
+  }
+  return 0;
+}
+
+CELL rxFill(VM *vm, int sock, struct rxRing *r)
+{
+  struct msghdr m;
+  struct iovec v[2];
+  ssize_t x;
+
+  rxFlush(vm, sock);
+  memset(&m, 0, sizeof(m));
+  m.msg_iov = v;
+  m.msg_iovlen = rxRingSpans(r, r->tail, SOCKET_RING - (r->tail - r->head), v);
+  vm->socketCalls++;
+  if ((x = recvmsg(sock, &m, 0)) > 0)
+    r->tail += x;
+  return rxSocketResult(x);
+}
+
+void rxRingTake(VM *vm, struct rxRing *r, CELL a, CELL n)
+{
+  CELL i;
+  for (i = 0; i < n; i++)
+    vm->image[a + i] = r->data[(r->head + i) % SOCKET_RING];
+  r->head += n;
+}
+
 /* Sockets Support ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
 void rsocket(VM *vm)
 {
@@ -311,6 +469,8 @@ void rbind(VM *vm)
   struct sockaddr_in address;
   int port = TOS; DROP;
   int sock = TOS;
+  int reuse = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
   address.sin_family = AF_INET;
   address.sin_addr.s_addr = INADDR_ANY;
   address.sin_port = htons(port);
@@ -320,7 +480,7 @@ void rbind(VM *vm)
 void rlisten(VM *vm)
 {
   int sock = TOS;
-  TOS = listen(sock, 3);
+  TOS = listen(sock, SOMAXCONN);
 }
 
 void raccept(VM *vm)
@@ -335,6 +495,12 @@ void raccept(VM *vm)
 void rclose(VM *vm)
 {
   int sock = TOS;
+  int i;
+  for (i = vm->next; i < vm->ready; i++)
+    if (vm->events[i].data.fd == sock)
+      vm->events[i].data.fd = -1;
+  rxFlush(vm, sock);
+  rxFreeRings(vm, sock);
   shutdown(sock, SHUT_RDWR);
   TOS = close(sock);
 }
@@ -343,21 +509,21 @@ void rsend(VM *vm)
 {
   int sock = TOS; DROP;
   int data = TOS;
-  char s[65535];
-  int  c;
-  for (c = 0; c < 65535; c++)
-    s[c] = '\0';
-  for (c = 0; vm->image[data] != 0; c++, data++)
-    s[c] = (char)vm->image[data];
-  TOS = send(sock, s, strlen(s), 0);
+  int c;
+  for (c = 0; c < SOCKET_BUFFER && vm->image[data] != 0; c++, data++)
+    vm->buffer[c] = (unsigned char)vm->image[data];
+  rxFlush(vm, sock);
+  vm->socketCalls++;
+  TOS = send(sock, vm->buffer, c, MSG_NOSIGNAL);
 }
 
 void rrecv(VM *vm)
 {
   int sock = TOS;
-  char s[2] = { 0, 0 };
-  recv(sock, s, 1, 0);
-  TOS = (int)s[0];
+  struct rxRing *r = rxSocketRing(vm, sock, 0);
+  TOS = 0;
+  if (r != NULL && (r->head != r->tail || rxFill(vm, sock, r) > 0))
+    TOS = r->data[r->head++ % SOCKET_RING];
 }
 
 void rconnect(VM *vm)
@@ -387,6 +553,227 @@ void rconnect(VM *vm)
   TOS = connect(sock, (struct sockaddr *)&address, (socklen_t)addrlen);
 }
 
+/* Socket Events ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   A socket made nonblocking (-9) can be watched (-10) for the events
+   below. -11 then waits up to the given number of milliseconds (-1 for
+   no limit) and returns the next ready socket and its events, or -1 0
+   if none became ready. One image can serve many connections this way
+   without blocking on any one of them.
+
+     1  readable, or a connection is waiting to be accepted
+     2  writable
+     4  closed by the peer, or failed
+
+   A mask of 0 stops watching the socket. Closing a socket also stops
+   watching it.
+
+   -12 and -13 move up to SOCKET_BUFFER bytes between the cells at a
+   and a socket in one call. They return the number of bytes moved, 0
+   if the connection is closed or failed, or -1 if the socket is not
+   ready.
+   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+CELL rxSocketBuffer(VM *vm, CELL *a)
+{
+  CELL n = TOS; DROP;
+  *a = TOS;
+  if (n > SOCKET_BUFFER)
+    n = SOCKET_BUFFER;
+  if (*a < 0 || n < 0 || n > IMAGE_SIZE - *a)
+    return -1;
+  return n;
+}
+
+void rnonblock(VM *vm)
+{
+  int sock = TOS;
+  int flags = fcntl(sock, F_GETFL, 0);
+  TOS = (flags == -1) ? -1 : fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+void rwatch(VM *vm)
+{
+  struct epoll_event event;
+  int mask = TOS; DROP;
+  int sock = TOS;
+
+  if (vm->poller == -1 && (vm->poller = epoll_create1(0)) == -1) {
+    TOS = -1;
+    return;
+  }
+  if (mask == 0) {
+    TOS = epoll_ctl(vm->poller, EPOLL_CTL_DEL, sock, NULL);
+    return;
+  }
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLRDHUP;
+  if (mask & 1)
+    event.events |= EPOLLIN;
+  if (mask & 2)
+    event.events |= EPOLLOUT;
+  event.data.fd = sock;
+  TOS = epoll_ctl(vm->poller, EPOLL_CTL_MOD, sock, &event);
+  if (TOS == -1 && errno == ENOENT)
+    TOS = epoll_ctl(vm->poller, EPOLL_CTL_ADD, sock, &event);
+}
+
+void rnext(VM *vm)
+{
+  int timeout = TOS;
+  int sock = -1, waited = 0;
+  uint32_t events = 0;
+
+  while (sock == -1) {
+    if (vm->next == vm->ready) {
+      if (waited++ || vm->poller == -1)
+        break;
+      vm->next = 0;
+      vm->ready = epoll_wait(vm->poller, vm->events, MAX_EVENTS, timeout);
+      if (vm->ready < 0)
+        vm->ready = 0;
+    }
+    else {
+      events = vm->events[vm->next].events;
+      sock = vm->events[vm->next++].data.fd;
+    }
+  }
+  TOS = sock;
+  vm->sp++;
+  TOS = 0;
+  if (sock != -1) {
+    if (events & EPOLLIN)
+      TOS |= 1;
+    if (events & EPOLLOUT)
+      TOS |= 2;
+    if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+      TOS |= 4;
+  }
+}
+
+void rsendbuffer(VM *vm)
+{
+  int sock = TOS; DROP;
+  CELL a, i, n;
+  if ((n = rxSocketBuffer(vm, &a)) < 0) {
+    TOS = 0;
+    return;
+  }
+  for (i = 0; i < n; i++)
+    vm->buffer[i] = (unsigned char)vm->image[a + i];
+  if ((i = rxFlush(vm, sock)) != 0) {
+    TOS = (i > 0) ? -1 : 0;
+    return;
+  }
+  vm->socketCalls++;
+  TOS = rxSocketResult(send(sock, vm->buffer, n, MSG_NOSIGNAL));
+}
+
+void rrecvbuffer(VM *vm)
+{
+  int sock = TOS; DROP;
+  CELL a, i, n;
+  struct rxRing *r;
+  if ((n = rxSocketBuffer(vm, &a)) < 0) {
+    TOS = 0;
+    return;
+  }
+  if ((r = rxSocketRing(vm, sock, 0)) != NULL && r->head != r->tail) {
+    if (n > (CELL)(r->tail - r->head))
+      n = r->tail - r->head;
+    rxRingTake(vm, r, a, n);
+    TOS = n;
+    return;
+  }
+  rxFlush(vm, sock);
+  vm->socketCalls++;
+  TOS = n = rxSocketResult(recv(sock, vm->buffer, n, 0));
+  for (i = 0; i < n; i++)
+    vm->image[a + i] = vm->buffer[i];
+}
+
+void rwrite(VM *vm)
+{
+  int sock = TOS; DROP;
+  CELL data = TOS, n = 0;
+  struct rxRing *r = rxSocketRing(vm, sock, 1);
+
+  while (r != NULL && data >= 0 && data < IMAGE_SIZE && vm->image[data]) {
+    if (r->tail - r->head == SOCKET_RING && rxFlush(vm, sock) != 0)
+      break;
+    r->data[r->tail++ % SOCKET_RING] = (unsigned char)vm->image[data++];
+    n++;
+  }
+  TOS = n;
+}
+
+void rflush(VM *vm)
+{
+  TOS = rxFlush(vm, TOS);
+}
+
+void rrecvuntil(VM *vm)
+{
+  int sock = TOS; DROP;
+  CELL delimiter = TOS; DROP;
+  CELL a, i, n, used, x = 1;
+  struct rxRing *r;
+
+  n = rxSocketBuffer(vm, &a) - 1;
+  if (n > SOCKET_RING)
+    n = SOCKET_RING;
+  if (n < 0 || (r = rxSocketRing(vm, sock, 0)) == NULL) {
+    TOS = 0;
+    return;
+  }
+  for (i = 0; ; i++) {
+    used = r->tail - r->head;
+    if (i == used || i == n) {
+      if (i == n || (x = rxFill(vm, sock, r)) <= 0)
+        break;
+      i--;
+    }
+    else if (r->data[(r->head + i) % SOCKET_RING] == delimiter) {
+      i++;
+      break;
+    }
+  }
+  if (x == -1) {
+    TOS = -1;
+    return;
+  }
+  rxRingTake(vm, r, a, i);
+  vm->image[a + i] = 0;
+  TOS = i;
+}
+
+void rsendfile(VM *vm)
+{
+  int sock = TOS; DROP;
+  struct pollfd ready;
+  struct stat st;
+  off_t at = 0;
+  ssize_t x;
+  int file;
+
+  rxGetString(vm, TOS);
+  TOS = -1;
+  if ((file = open(vm->request, O_RDONLY)) == -1)
+    return;
+  if (fstat(file, &st) == 0 && rxFlush(vm, sock) >= 0) {
+    ready.fd = sock;
+    ready.events = POLLOUT;
+    while (at < st.st_size) {
+      vm->socketCalls++;
+      if ((x = sendfile(sock, file, &at, st.st_size - at)) > 0)
+        continue;
+      if (x == 0 || rxSocketResult(x) == 0)
+        break;
+      poll(&ready, 1, -1);
+    }
+    TOS = at;
+  }
+  close(file);
+}
+
 
 /* Device I/O Handler ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
 void rxDeviceHandler(VM *vm) {
@@ -507,6 +894,42 @@ void rxDeviceHandler(VM *vm) {
                  vm->ports[13] = 0;
                  vm->ports[0] = 1;
                  break;
+        case -9: rnonblock(vm);
+                 vm->ports[13] = 0;
+                 vm->ports[0] = 1;
+                 break;
+        case -10: rwatch(vm);
+                  vm->ports[13] = 0;
+                  vm->ports[0] = 1;
+                  break;
+        case -11: rnext(vm);
+                  vm->ports[13] = 0;
+                  vm->ports[0] = 1;
+                  break;
+        case -12: rsendbuffer(vm);
+                  vm->ports[13] = 0;
+                  vm->ports[0] = 1;
+                  break;
+        case -13: rrecvbuffer(vm);
+                  vm->ports[13] = 0;
+                  vm->ports[0] = 1;
+                  break;
+        case -14: rwrite(vm);
+                  vm->ports[13] = 0;
+                  vm->ports[0] = 1;
+                  break;
+        case -15: rflush(vm);
+                  vm->ports[13] = 0;
+                  vm->ports[0] = 1;
+                  break;
+        case -16: rrecvuntil(vm);
+                  vm->ports[13] = 0;
+                  vm->ports[0] = 1;
+                  break;
+        case -17: rsendfile(vm);
+                  vm->ports[13] = 0;
+                  vm->ports[0] = 1;
+                  break;
         default:
                  vm->ports[13] = 0;
                  vm->ports[0] = 1;
@@ -757,6 +1180,7 @@ void rxDisplayStats(VM *vm)
   printf("CALL:    %d\n", vm->stats[NUM_OPS]);
   printf("Max SP:  %d\n", vm->max_sp);
   printf("Max RSP: %d\n", vm->max_rsp);
+  printf("Socket I/O calls: %ld\n", vm->socketCalls);
 
   for (s = i = 0; s < NUM_OPS; s++)
     i += vm->stats[s];
@@ -771,6 +1195,7 @@ int main(int argc, char **argv) {
   wantsStats = 0;
   vm = calloc(sizeof(VM), sizeof(char));
   strcpy(vm->filename, LOCAL);
+  vm->poller = -1;
 
   rxPrepareInput(vm);
 